@@ -0,0 +1,247 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "arena.h"
+
+
+/* Slabs are chained together, the usable memory follows the header */
+struct slab {
+    struct slab *next;
+    char pad[ARENA_ALIGN - sizeof(struct slab *)];
+};
+
+/*
+ * Oversized blocks are kept in a doubly linked list to be unlinked on free,
+ * the header takes ARENA_ALIGN bytes to keep the payload aligned
+ */
+struct big {
+    struct big *prev;
+    struct big *next;
+};
+
+/* A free block stores the pointer to the next free block of the same class */
+struct block {
+    struct block *next;
+};
+
+
+static inline size_t size_class(size_t size) {
+    return (size + ARENA_ALIGN - 1) / ARENA_ALIGN - 1;
+}
+
+
+static inline size_t class_size(size_t cls) {
+    return (cls + 1) * ARENA_ALIGN;
+}
+
+
+static int arena_grow(struct arena *a) {
+
+    struct slab *s = malloc(sizeof(*s) + ARENA_SLAB_SIZE);
+
+    if (!s)
+        return -1;
+
+    s->next = a->slabs;
+    a->slabs = s;
+    a->bump = (char *) (s + 1);
+    a->limit = a->bump + ARENA_SLAB_SIZE;
+    a->stats.slabs++;
+
+    return 0;
+}
+
+
+static void *arena_alloc_big(struct arena *a, size_t size) {
+
+    struct big *b = malloc(ARENA_ALIGN + size);
+
+    if (!b)
+        return NULL;
+
+    b->prev = NULL;
+    b->next = a->bigs;
+    if (a->bigs)
+        a->bigs->prev = b;
+    a->bigs = b;
+    a->stats.bigs++;
+    a->stats.misses++;
+
+    return (char *) b + ARENA_ALIGN;
+}
+
+
+static void arena_free_big(struct arena *a, void *ptr) {
+
+    struct big *b = (struct big *) ((char *) ptr - ARENA_ALIGN);
+
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        a->bigs = b->next;
+
+    if (b->next)
+        b->next->prev = b->prev;
+
+    a->stats.bigs--;
+    free(b);
+}
+
+
+void arena_init(struct arena *a) {
+    memset(a, 0x00, sizeof(*a));
+}
+
+
+void arena_release(struct arena *a) {
+
+    while (a->slabs) {
+        struct slab *s = a->slabs;
+        a->slabs = s->next;
+        free(s);
+    }
+
+    while (a->bigs) {
+        struct big *b = a->bigs;
+        a->bigs = b->next;
+        free(b);
+    }
+
+    arena_init(a);
+}
+
+
+void arena_reset(struct arena *a) {
+
+    /* Keep the most recent slab, every other one goes back to the system */
+    struct slab *keep = a->slabs;
+
+    if (keep) {
+        while (keep->next) {
+            struct slab *s = keep->next;
+            keep->next = s->next;
+            free(s);
+        }
+        a->bump = (char *) (keep + 1);
+        a->limit = a->bump + ARENA_SLAB_SIZE;
+        a->stats.slabs = 1;
+    }
+
+    while (a->bigs) {
+        struct big *b = a->bigs;
+        a->bigs = b->next;
+        free(b);
+    }
+
+    a->stats.bigs = 0;
+    memset(a->free_lists, 0x00, sizeof(a->free_lists));
+}
+
+
+void *arena_alloc(struct arena *a, size_t size) {
+
+    assert(a);
+
+    if (size == 0)
+        size = 1;
+
+    if (size > ARENA_MAX_CLASS)
+        return arena_alloc_big(a, size);
+
+    size_t cls = size_class(size);
+    struct block *b = a->free_lists[cls];
+
+    /* Fast path, recycle a block from the class free list */
+    if (b) {
+        a->free_lists[cls] = b->next;
+        a->stats.hits++;
+        return b;
+    }
+
+    size_t bytes = class_size(cls);
+
+    if (a->bump + bytes > a->limit && arena_grow(a) < 0)
+        return NULL;
+
+    void *ptr = a->bump;
+    a->bump += bytes;
+    a->stats.misses++;
+
+    return ptr;
+}
+
+
+void arena_free(struct arena *a, void *ptr, size_t size) {
+
+    if (!ptr)
+        return;
+
+    if (size == 0)
+        size = 1;
+
+    if (size > ARENA_MAX_CLASS) {
+        arena_free_big(a, ptr);
+        return;
+    }
+
+    size_t cls = size_class(size);
+    struct block *b = ptr;
+
+    b->next = a->free_lists[cls];
+    a->free_lists[cls] = b;
+}
+
+
+void *arena_realloc(struct arena *a, void *ptr, size_t old_size, size_t size) {
+
+    if (!ptr)
+        return arena_alloc(a, size);
+
+    /* Same size class, nothing to move */
+    if (old_size <= ARENA_MAX_CLASS && size <= ARENA_MAX_CLASS
+        && size_class(old_size ? old_size : 1) == size_class(size ? size : 1))
+        return ptr;
+
+    void *nptr = arena_alloc(a, size);
+
+    if (!nptr)
+        return NULL;
+
+    memcpy(nptr, ptr, old_size < size ? old_size : size);
+    arena_free(a, ptr, old_size);
+
+    return nptr;
+}
+
+
+void arena_stats(const struct arena *a, struct arena_stats *stats) {
+    *stats = a->stats;
+}
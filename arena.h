@@ -0,0 +1,90 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+
+/*
+ * Blocks up to ARENA_MAX_CLASS bytes are served from size classes, each one a
+ * multiple of ARENA_ALIGN, carved out of ARENA_SLAB_SIZE slabs. Bigger blocks
+ * fall back to malloc but are still tracked by the arena, so that a reset
+ * reclaims them as well.
+ */
+#define ARENA_ALIGN         16
+#define ARENA_MAX_CLASS     1024
+#define ARENA_CLASSES       (ARENA_MAX_CLASS / ARENA_ALIGN)
+#define ARENA_SLAB_SIZE     (64 * 1024)
+
+
+struct arena_stats {
+    size_t hits;        /* Allocations served by a size class free list */
+    size_t misses;      /* Allocations carved from a slab or malloc'ed */
+    size_t slabs;       /* Slabs currently owned by the arena */
+    size_t bigs;        /* Oversized blocks currently owned by the arena */
+};
+
+
+struct arena {
+    struct slab *slabs;
+    struct big *bigs;
+    char *bump;
+    char *limit;
+    void *free_lists[ARENA_CLASSES];
+    struct arena_stats stats;
+};
+
+
+/* Init an empty arena, no memory is allocated until the first request */
+void arena_init(struct arena *);
+
+/* Release every slab and every oversized block owned by the arena */
+void arena_release(struct arena *);
+
+/*
+ * Drop every allocation in one go, keeping a single slab around to serve the
+ * next round of requests without going back to malloc.
+ */
+void arena_reset(struct arena *);
+
+void *arena_alloc(struct arena *, size_t);
+
+/*
+ * Return a block to its size class, the size must be the same requested on
+ * allocation (or on the last arena_realloc)
+ */
+void arena_free(struct arena *, void *, size_t);
+
+void *arena_realloc(struct arena *, void *, size_t, size_t);
+
+void arena_stats(const struct arena *, struct arena_stats *);
+
+
+#endif
@@ -0,0 +1,184 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Throughput of the concurrent HashTable from 1 to 32 threads, against a
+ * plain HashTable behind a single mutex. Every thread runs the same mix of
+ * gets and puts on a shared set of keys.
+ *
+ * Usage: chashtable_bench [keys] [ops per thread] [percentage of puts]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "../chashtable.h"
+
+
+#define MAX_THREADS     32
+
+
+static struct {
+    char **keys;
+    size_t nkeys;
+    size_t ops;
+    unsigned puts;
+    CHashTable *ctable;
+    HashTable *table;
+    pthread_mutex_t lock;
+} bench;
+
+
+static int nop_destructor(struct ht_entry *entry) {
+    (void) entry;
+    return HASHTABLE_OK;
+}
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* xorshift, cheap enough not to show up in the measures */
+static inline uint64_t next_rand(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+
+static void *run_concurrent(void *arg) {
+
+    uint64_t state = (uintptr_t) arg * 0x9E3779B97F4A7C15ULL + 1;
+    size_t misses = 0;
+
+    for (size_t i = 0; i < bench.ops; i++) {
+        uint64_t r = next_rand(&state);
+        char *key = bench.keys[r % bench.nkeys];
+        if ((r >> 32) % 100 < bench.puts)
+            chashtable_put(bench.ctable, key, key);
+        else if (chashtable_get(bench.ctable, key) != key)
+            misses++;
+    }
+
+    return (void *) misses;
+}
+
+
+static void *run_locked(void *arg) {
+
+    uint64_t state = (uintptr_t) arg * 0x9E3779B97F4A7C15ULL + 1;
+    size_t misses = 0;
+
+    for (size_t i = 0; i < bench.ops; i++) {
+        uint64_t r = next_rand(&state);
+        char *key = bench.keys[r % bench.nkeys];
+        pthread_mutex_lock(&bench.lock);
+        if ((r >> 32) % 100 < bench.puts)
+            hashtable_put(bench.table, key, key);
+        else if (hashtable_get(bench.table, key) != key)
+            misses++;
+        pthread_mutex_unlock(&bench.lock);
+    }
+
+    return (void *) misses;
+}
+
+
+/* Million operations per second with n threads */
+static double measure(void *(*run)(void *), int n, size_t *misses) {
+
+    pthread_t threads[MAX_THREADS];
+    double start = now();
+
+    for (int i = 0; i < n; i++)
+        pthread_create(&threads[i], NULL, run, (void *) (uintptr_t) (i + 1));
+
+    for (int i = 0; i < n; i++) {
+        void *m;
+        pthread_join(threads[i], &m);
+        *misses += (size_t) m;
+    }
+
+    return n * bench.ops / (now() - start) / 1e6;
+}
+
+
+int main(int argc, char **argv) {
+
+    bench.nkeys = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    bench.ops = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    bench.puts = argc > 3 ? strtoul(argv[3], NULL, 10) : 10;
+
+    bench.keys = malloc(bench.nkeys * sizeof(*bench.keys));
+    bench.ctable = chashtable_create(nop_destructor);
+    bench.table = hashtable_create(nop_destructor);
+    pthread_mutex_init(&bench.lock, NULL);
+
+    for (size_t i = 0; i < bench.nkeys; i++) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "symbol-%zu", i);
+        bench.keys[i] = malloc(strlen(buf) + 1);
+        strcpy(bench.keys[i], buf);
+        chashtable_put(bench.ctable, bench.keys[i], bench.keys[i]);
+        hashtable_put(bench.table, bench.keys[i], bench.keys[i]);
+    }
+
+    printf("%zu keys, %zu ops per thread, %u%% puts\n\n",
+           bench.nkeys, bench.ops, bench.puts);
+    printf("threads   concurrent Mops/s   mutex Mops/s\n");
+
+    size_t misses = 0;
+
+    for (int n = 1; n <= MAX_THREADS; n *= 2) {
+        double c = measure(run_concurrent, n, &misses);
+        double l = measure(run_locked, n, &misses);
+        printf("%7d   %19.2f   %12.2f\n", n, c, l);
+    }
+
+    /* Values are never removed, every get must find its key */
+    if (misses)
+        printf("\n%zu lookups failed\n", misses);
+
+    chashtable_release(bench.ctable);
+    hashtable_release(bench.table);
+
+    for (size_t i = 0; i < bench.nkeys; i++)
+        free(bench.keys[i]);
+    free(bench.keys);
+
+    return misses ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,587 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "bigint.h"
+
+
+typedef uint32_t limb;
+typedef uint64_t dlimb;
+
+
+#define LIMB_BITS       32
+#define LIMB_MASK       0xFFFFFFFFu
+
+/* Decimal chunks, the biggest power of 10 fitting a limb */
+#define DEC_CHUNK       1000000000u
+#define DEC_CHUNK_LEN   9
+
+
+static const limb pow10[DEC_CHUNK_LEN + 1] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+
+/*
+ * Natural numbers are plain arrays of limbs with their length, the nat_*
+ * routines never allocate the result, the caller makes room for it.
+ */
+static inline int nat_norm(const limb *a, int n) {
+    while (n > 0 && a[n - 1] == 0)
+        n--;
+    return n;
+}
+
+
+/* Zero has no limbs, its array may well be NULL */
+static inline void nat_copy(limb *r, const limb *a, int n) {
+    if (n > 0)
+        memcpy(r, a, n * sizeof(limb));
+}
+
+
+static int nat_cmp(const limb *a, int an, const limb *b, int bn) {
+
+    if (an != bn)
+        return an < bn ? -1 : 1;
+
+    for (int i = an - 1; i >= 0; i--)
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
+
+    return 0;
+}
+
+
+/* r = a + b with an >= bn, r has room for an + 1 limbs */
+static void nat_add(limb *r, const limb *a, int an, const limb *b, int bn) {
+
+    dlimb c = 0;
+    int i = 0;
+
+    for (; i < bn; i++) {
+        c += (dlimb) a[i] + b[i];
+        r[i] = (limb) c;
+        c >>= LIMB_BITS;
+    }
+
+    for (; i < an; i++) {
+        c += a[i];
+        r[i] = (limb) c;
+        c >>= LIMB_BITS;
+    }
+
+    r[an] = (limb) c;
+}
+
+
+/* r = a - b with a >= b, r has room for an limbs */
+static void nat_sub(limb *r, const limb *a, int an, const limb *b, int bn) {
+
+    dlimb borrow = 0;
+    int i = 0;
+
+    for (; i < bn; i++) {
+        dlimb t = (dlimb) a[i] - b[i] - borrow;
+        r[i] = (limb) t;
+        borrow = t >> 63;
+    }
+
+    for (; i < an; i++) {
+        dlimb t = (dlimb) a[i] - borrow;
+        r[i] = (limb) t;
+        borrow = t >> 63;
+    }
+}
+
+
+/* r += b in place, the sum must fit the rn limbs of r */
+static void nat_add_into(limb *r, int rn, const limb *b, int bn) {
+
+    dlimb c = 0;
+    int i = 0;
+
+    for (; i < bn; i++) {
+        c += (dlimb) r[i] + b[i];
+        r[i] = (limb) c;
+        c >>= LIMB_BITS;
+    }
+
+    for (; c && i < rn; i++) {
+        c += r[i];
+        r[i] = (limb) c;
+        c >>= LIMB_BITS;
+    }
+}
+
+
+/* r -= b in place, with r >= b */
+static void nat_sub_from(limb *r, int rn, const limb *b, int bn) {
+
+    dlimb borrow = 0;
+    int i = 0;
+
+    for (; i < bn; i++) {
+        dlimb t = (dlimb) r[i] - b[i] - borrow;
+        r[i] = (limb) t;
+        borrow = t >> 63;
+    }
+
+    for (; borrow && i < rn; i++) {
+        dlimb t = (dlimb) r[i] - borrow;
+        r[i] = (limb) t;
+        borrow = t >> 63;
+    }
+}
+
+
+/* r = a * b, r has room for an + bn limbs, all of them are written */
+static void nat_mul_basecase(limb *r, const limb *a, int an,
+                             const limb *b, int bn) {
+
+    memset(r, 0, (an + bn) * sizeof(limb));
+
+    for (int i = 0; i < bn; i++) {
+        dlimb c = 0;
+        for (int j = 0; j < an; j++) {
+            c += (dlimb) a[j] * b[i] + r[i + j];
+            r[i + j] = (limb) c;
+            c >>= LIMB_BITS;
+        }
+        r[i + an] = (limb) c;
+    }
+}
+
+
+/*
+ * r = a * b, r has room for an + bn limbs, all of them are written. Past the
+ * cutoff the operands are split in halves, a = a1 B + a0 and b = b1 B + b0,
+ * and the middle term comes out of a single product:
+ *
+ *   a b = a1 b1 B^2 + ((a0 + a1)(b0 + b1) - a0 b0 - a1 b1) B + a0 b0
+ *
+ * Operands much shorter than the other are multiplied by slices of it.
+ */
+static void nat_mul(limb *r, const limb *a, int an, const limb *b, int bn) {
+
+    if (an < bn) {
+        const limb *t = a;
+        a = b;
+        b = t;
+        int tn = an;
+        an = bn;
+        bn = tn;
+    }
+
+    if (bn < BIGINT_KARATSUBA_CUTOFF) {
+        nat_mul_basecase(r, a, an, b, bn);
+        return;
+    }
+
+    memset(r, 0, (an + bn) * sizeof(limb));
+
+    if (2 * bn <= an) {
+        limb *t = malloc(2 * bn * sizeof(limb));
+        for (int i = 0; i < an; i += bn) {
+            int n = an - i < bn ? an - i : bn;
+            nat_mul(t, a + i, n, b, bn);
+            nat_add_into(r + i, an + bn - i, t, n + bn);
+        }
+        free(t);
+        return;
+    }
+
+    /* Here bn > an / 2, so b is split at the same point of a */
+    int m = (an + 1) / 2;
+    int a0n = nat_norm(a, m), b0n = nat_norm(b, m);
+    int a1n = an - m, b1n = bn - m;
+    limb *sa = malloc((4 * m + 4) * sizeof(limb));
+    limb *sb = sa + m + 1;
+    limb *z1 = sb + m + 1;
+
+    nat_mul(r, a, a0n, b, b0n);
+    nat_mul(r + 2 * m, a + m, a1n, b + m, b1n);
+
+    nat_add(sa, a, m, a + m, a1n);
+    nat_add(sb, b, m, b + m, b1n);
+    memset(z1, 0, (2 * m + 2) * sizeof(limb));
+    nat_mul(z1, sa, nat_norm(sa, m + 1), sb, nat_norm(sb, m + 1));
+
+    nat_sub_from(z1, 2 * m + 2, r, 2 * m);
+    nat_sub_from(z1, 2 * m + 2, r + 2 * m, an + bn - 2 * m);
+    nat_add_into(r + m, an + bn - m, z1, nat_norm(z1, 2 * m + 2));
+
+    free(sa);
+}
+
+
+/* q = a / d, returning a % d, q can be a itself */
+static limb nat_divmod_1(limb *q, const limb *a, int n, limb d) {
+
+    dlimb r = 0;
+
+    for (int i = n - 1; i >= 0; i--) {
+        r = (r << LIMB_BITS) | a[i];
+        q[i] = (limb) (r / d);
+        r %= d;
+    }
+
+    return (limb) r;
+}
+
+
+/* Count of leading zero bits of a non zero limb */
+static inline int limb_clz(limb x) {
+#ifdef __GNUC__
+    return __builtin_clz(x);
+#else
+    int n = 0;
+    while (!(x & 0x80000000u)) {
+        x <<= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+
+/*
+ * Knuth's algorithm D, q = a / b and r = a % b with an >= bn > 1 and no
+ * leading zero in b. q has room for an - bn + 1 limbs, r for bn.
+ */
+static void nat_divmod(limb *q, limb *r, const limb *a, int an,
+                       const limb *b, int bn) {
+
+    int s = limb_clz(b[bn - 1]);
+    limb *u = malloc((an + 1 + bn) * sizeof(limb));
+    limb *v = u + an + 1;
+
+    /* Shift b so that its top bit is set, a along with it */
+    for (int i = bn - 1; i > 0; i--)
+        v[i] = (b[i] << s) | (limb) ((dlimb) b[i - 1] >> (LIMB_BITS - s));
+    v[0] = b[0] << s;
+
+    u[an] = (limb) ((dlimb) a[an - 1] >> (LIMB_BITS - s));
+    for (int i = an - 1; i > 0; i--)
+        u[i] = (a[i] << s) | (limb) ((dlimb) a[i - 1] >> (LIMB_BITS - s));
+    u[0] = a[0] << s;
+
+    for (int j = an - bn; j >= 0; j--) {
+
+        /* Estimate the quotient limb from the top two limbs, off by 2 */
+        dlimb num = ((dlimb) u[j + bn] << LIMB_BITS) | u[j + bn - 1];
+        dlimb qhat = num / v[bn - 1];
+        dlimb rhat = num % v[bn - 1];
+
+        while (qhat > LIMB_MASK
+               || qhat * v[bn - 2] > ((rhat << LIMB_BITS) | u[j + bn - 2])) {
+            qhat--;
+            rhat += v[bn - 1];
+            if (rhat > LIMB_MASK)
+                break;
+        }
+
+        /* Multiply and subtract, adding back if qhat was still 1 too big */
+        int64_t k = 0, t;
+
+        for (int i = 0; i < bn; i++) {
+            dlimb p = qhat * v[i];
+            t = (int64_t) u[i + j] - k - (int64_t) (p & LIMB_MASK);
+            u[i + j] = (limb) t;
+            k = (int64_t) (p >> LIMB_BITS) - (t >> LIMB_BITS);
+        }
+
+        t = (int64_t) u[j + bn] - k;
+        u[j + bn] = (limb) t;
+
+        if (t < 0) {
+            dlimb c = 0;
+            qhat--;
+            for (int i = 0; i < bn; i++) {
+                c += (dlimb) u[i + j] + v[i];
+                u[i + j] = (limb) c;
+                c >>= LIMB_BITS;
+            }
+            u[j + bn] += (limb) c;
+        }
+
+        q[j] = (limb) qhat;
+    }
+
+    for (int i = 0; i < bn - 1; i++)
+        r[i] = (u[i] >> s) | (limb) ((dlimb) u[i + 1] << (LIMB_BITS - s));
+    r[bn - 1] = u[bn - 1] >> s;
+
+    free(u);
+}
+
+
+/* Give r the n limbs of a new buffer as magnitude, releasing the old one */
+static void bigint_take(struct bigint *r, limb *limbs,
+                        int n, bool negative) {
+    free(r->limbs);
+    r->limbs = limbs;
+    r->capacity = n;
+    r->size = nat_norm(limbs, n);
+    r->negative = r->size > 0 && negative;
+}
+
+
+void bigint_init(struct bigint *b) {
+    b->negative = false;
+    b->size = b->capacity = 0;
+    b->limbs = NULL;
+}
+
+
+void bigint_free(struct bigint *b) {
+    free(b->limbs);
+    bigint_init(b);
+}
+
+
+void bigint_set_ll(struct bigint *b, long long x) {
+
+    uint64_t m = x < 0 ? -(uint64_t) x : (uint64_t) x;
+    limb limbs[2] = { (limb) m, (limb) (m >> LIMB_BITS) };
+
+    bigint_set_limbs(b, limbs, 2, x < 0);
+}
+
+
+void bigint_set_limbs(struct bigint *b, const uint32_t *limbs,
+                      int n, bool negative) {
+
+    n = nat_norm(limbs, n);
+
+    if (n > b->capacity) {
+        b->limbs = realloc(b->limbs, n * sizeof(limb));
+        b->capacity = n;
+    }
+
+    nat_copy(b->limbs, limbs, n);
+    b->size = n;
+    b->negative = n > 0 && negative;
+}
+
+
+bool bigint_get_ll(const struct bigint *b, long long *x) {
+
+    if (b->size > 2)
+        return false;
+
+    uint64_t m = b->size > 0 ? b->limbs[0] : 0;
+    if (b->size == 2)
+        m |= (uint64_t) b->limbs[1] << LIMB_BITS;
+
+    if (m > (uint64_t) LLONG_MAX + b->negative)
+        return false;
+
+    *x = b->negative ? (long long) -(m - 1) - 1 : (long long) m;
+
+    return true;
+}
+
+
+double bigint_to_double(const struct bigint *b) {
+
+    double x = 0.0;
+
+    for (int i = b->size - 1; i >= 0; i--)
+        x = x * 4294967296.0 + b->limbs[i];
+
+    return b->negative ? -x : x;
+}
+
+
+/* Add the magnitudes if the signs agree, subtract the smaller otherwise */
+static void bigint_addsub(struct bigint *r, const struct bigint *a,
+                          const struct bigint *b, bool bneg) {
+
+    int an = a->size, bn = b->size;
+    int n = (an > bn ? an : bn) + 1;
+    limb *t = malloc(n * sizeof(limb));
+    bool negative;
+
+    if (a->negative == bneg) {
+        if (an >= bn)
+            nat_add(t, a->limbs, an, b->limbs, bn);
+        else
+            nat_add(t, b->limbs, bn, a->limbs, an);
+        negative = bneg;
+    } else if (nat_cmp(a->limbs, an, b->limbs, bn) >= 0) {
+        nat_sub(t, a->limbs, an, b->limbs, bn);
+        t[n - 1] = 0;
+        negative = a->negative;
+    } else {
+        nat_sub(t, b->limbs, bn, a->limbs, an);
+        t[n - 1] = 0;
+        negative = bneg;
+    }
+
+    bigint_take(r, t, n, negative);
+}
+
+
+void bigint_add(struct bigint *r, const struct bigint *a,
+                const struct bigint *b) {
+    bigint_addsub(r, a, b, b->negative);
+}
+
+
+void bigint_sub(struct bigint *r, const struct bigint *a,
+                const struct bigint *b) {
+    bigint_addsub(r, a, b, !b->negative);
+}
+
+
+void bigint_mul(struct bigint *r, const struct bigint *a,
+                const struct bigint *b) {
+
+    int n = a->size + b->size;
+    limb *t = malloc((n > 0 ? n : 1) * sizeof(limb));
+
+    nat_mul(t, a->limbs, a->size, b->limbs, b->size);
+    bigint_take(r, t, n, a->negative != b->negative);
+}
+
+
+int bigint_divmod(struct bigint *q, struct bigint *r,
+                  const struct bigint *a, const struct bigint *b) {
+
+    int an = a->size, bn = b->size;
+
+    if (bn == 0)
+        return -1;
+
+    int qn = an >= bn ? an - bn + 1 : 1;
+    limb *ql = calloc(qn, sizeof(limb));
+    limb *rl = calloc(an > bn ? an : bn, sizeof(limb));
+
+    if (nat_cmp(a->limbs, an, b->limbs, bn) < 0)
+        nat_copy(rl, a->limbs, an);
+    else if (bn == 1)
+        rl[0] = nat_divmod_1(ql, a->limbs, an, b->limbs[0]);
+    else
+        nat_divmod(ql, rl, a->limbs, an, b->limbs, bn);
+
+    /* Both are computed before writing, q or r may be a or b */
+    bool negative = a->negative;
+
+    if (q)
+        bigint_take(q, ql, qn, negative != b->negative);
+    else
+        free(ql);
+
+    if (r)
+        bigint_take(r, rl, an > bn ? an : bn, negative);
+    else
+        free(rl);
+
+    return 0;
+}
+
+
+/*
+ * Peel off 9 decimal digits at a time, dividing by 10^9, and print the
+ * chunks from the most significant one
+ */
+char *bigint_to_string(const struct bigint *b) {
+
+    int n = b->size;
+    limb *t = malloc((n > 0 ? n : 1) * sizeof(limb));
+    limb *chunks = malloc((n + n / 8 + 1) * sizeof(limb));
+    int c = 0;
+
+    nat_copy(t, b->limbs, n);
+
+    while (n > 0) {
+        chunks[c++] = nat_divmod_1(t, t, n, DEC_CHUNK);
+        n = nat_norm(t, n);
+    }
+
+    char *str = malloc(c * DEC_CHUNK_LEN + 3);
+    char *p = str;
+
+    if (b->negative)
+        *p++ = '-';
+
+    p += sprintf(p, "%u", c > 0 ? chunks[c - 1] : 0);
+    for (int i = c - 2; i >= 0; i--)
+        p += sprintf(p, "%09u", chunks[i]);
+
+    free(chunks);
+    free(t);
+
+    return str;
+}
+
+
+int bigint_from_string(struct bigint *b, const char *str) {
+
+    bool negative = *str == '-';
+
+    if (negative)
+        str++;
+
+    size_t len = strlen(str);
+
+    if (len == 0 || strspn(str, "0123456789") != len)
+        return -1;
+
+    int capacity = len / DEC_CHUNK_LEN + 2;
+    limb *t = calloc(capacity, sizeof(limb));
+    int n = 0;
+
+    /* The first chunk takes the odd digits, the others 9 each */
+    size_t k = len % DEC_CHUNK_LEN ? len % DEC_CHUNK_LEN : DEC_CHUNK_LEN;
+
+    for (size_t i = 0; i < len; i += k, k = DEC_CHUNK_LEN) {
+
+        dlimb c = 0;
+
+        for (size_t j = i; j < i + k; j++)
+            c = c * 10 + (str[j] - '0');
+
+        for (int j = 0; j < n; j++) {
+            c += (dlimb) t[j] * pow10[k];
+            t[j] = (limb) c;
+            c >>= LIMB_BITS;
+        }
+
+        if (c)
+            t[n++] = (limb) c;
+    }
+
+    bigint_take(b, t, capacity, negative);
+
+    return 0;
+}
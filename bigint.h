@@ -0,0 +1,91 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BIGINT_H
+#define BIGINT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*
+ * Arbitrary precision integers, as a sign and a magnitude. The magnitude is
+ * an array of 32 bits limbs, least significant first, with no leading zero
+ * limbs: zero has no limbs at all and is never negative.
+ *
+ * The result of every operation may be one of its operands, values start
+ * zeroed by bigint_init and must be released with bigint_free.
+ */
+struct bigint {
+    bool negative;
+    int size;
+    int capacity;
+    uint32_t *limbs;
+};
+
+
+/* Operands at least this many limbs long are multiplied with Karatsuba */
+#define BIGINT_KARATSUBA_CUTOFF     32
+
+
+void bigint_init(struct bigint *);
+
+void bigint_free(struct bigint *);
+
+void bigint_set_ll(struct bigint *, long long);
+
+/* Set from a magnitude of n limbs, leading zeros are allowed */
+void bigint_set_limbs(struct bigint *, const uint32_t *, int, bool);
+
+/* Return false if the value doesn't fit a long long */
+bool bigint_get_ll(const struct bigint *, long long *);
+
+double bigint_to_double(const struct bigint *);
+
+void bigint_add(struct bigint *, const struct bigint *, const struct bigint *);
+
+void bigint_sub(struct bigint *, const struct bigint *, const struct bigint *);
+
+void bigint_mul(struct bigint *, const struct bigint *, const struct bigint *);
+
+/*
+ * Truncated division, like the one of C: the quotient rounds toward zero and
+ * the remainder takes the sign of the dividend. Either result can be NULL.
+ * Return -1 on division by zero.
+ */
+int bigint_divmod(struct bigint *, struct bigint *,
+                  const struct bigint *, const struct bigint *);
+
+/* Decimal representation, a new string to be freed */
+char *bigint_to_string(const struct bigint *);
+
+/* Parse an optionally signed string of decimal digits, -1 if malformed */
+int bigint_from_string(struct bigint *, const char *);
+
+
+#endif
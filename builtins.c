@@ -28,220 +28,1250 @@
 
 #include "builtins.h"
 #include "runtime.h"
+#include "vm.h"
+#include "bigint.h"
+#include "simd.h"
+#include "seq.h"
 
 #include <stdio.h>
 
 
+/* Integer operations checked for overflow, true if the result doesn't fit */
+static inline bool checked_add(long long a, long long b, long long *r) {
+#ifdef __GNUC__
+    return __builtin_add_overflow(a, b, r);
+#else
+    if ((b > 0 && a > LLONG_MAX - b) || (b < 0 && a < LLONG_MIN - b))
+        return true;
+    *r = a + b;
+    return false;
+#endif
+}
+
+
+static inline bool checked_sub(long long a, long long b, long long *r) {
+#ifdef __GNUC__
+    return __builtin_sub_overflow(a, b, r);
+#else
+    if ((b < 0 && a > LLONG_MAX + b) || (b > 0 && a < LLONG_MIN + b))
+        return true;
+    *r = a - b;
+    return false;
+#endif
+}
+
+
+static inline bool checked_mul(long long a, long long b, long long *r) {
+#ifdef __GNUC__
+    return __builtin_mul_overflow(a, b, r);
+#else
+    if (a > 0 ? (b > 0 ? a > LLONG_MAX / b : b < LLONG_MIN / a)
+        : (b > 0 ? a < LLONG_MIN / b : a != 0 && b < LLONG_MAX / a))
+        return true;
+    *r = a * b;
+    return false;
+#endif
+}
+
+
+/* Type of an argument, NULL when a builtin it came from returned nothing */
+static inline int arg_type(const struct expr *exp) {
+    return exp ? (int) expr_type(exp) : -1;
+}
+
+
+/*
+ * List builtins operate on the first argument or, when its first element is a
+ * list itself, on that element
+ */
+static struct expr *list_arg(struct expr *exp) {
+
+    struct expr *v = exp->children[0];
+    int type = expr_type(expr_peek(v, 0));
+
+    if (type == SEXP || type == QEXP)
+        v = expr_peek(v, 0);
+
+    return v;
+}
+
+
 struct expr *builtin_def(Context *ctx, struct expr *exp) {
 
-    if (exp->children[0]->etype != QEXP) {
-        expr_err(exp, "Function 'def' passed incorrect types!");
-        return exp;
-    }
+    if (expr_arg_count(exp) < 1 || arg_type(exp->children[0]) != QEXP)
+        return expr_new_err("Function 'def' passed incorrect types!");
 
     struct expr *e = exp->children[0];
 
+    if (expr_arg_count(exp) - 1 != e->count)
+        return expr_new_err("Function 'def' passed incorrect number of "
+                            "values!");
+
+    /* Integers are immediates, only symbols can be bound */
     for (int i = 0; i < e->count; i++)
-        context_put(ctx, e->children[i], exp->children[i + 1]);
+        if (expr_type(e->children[i]) != SYMBOL)
+            return expr_new_err("Function 'def' passed incorrect types!");
 
-    expr_del(exp);
+    for (int i = 0; i < e->count; i++) {
+        if (context_get_const(ctx, e->children[i]->symbol))
+            return expr_new_err("Function 'def' cannot redefine builtins!");
+        context_put(ctx, e->children[i], exp->children[i + 1]);
+    }
 
-    struct expr *aexp = malloc(sizeof(*aexp));
-    expr_sexp(aexp);
-    return aexp;
+    return expr_new_sexp();
 }
 
 
 struct expr *builtin_len(Context *ctx, struct expr *exp) {
 
-    if (exp->children[0]->etype != QEXP) {
-        expr_err(exp, "Function 'len' passed incorrect types!");
-        return exp;
+    if (arg_type(exp->children[0]) == VECTOR)
+        return expr_new_integer(exp->children[0]->count);
+
+    if (arg_type(exp->children[0]) != QEXP)
+        return expr_new_err("Function 'len' passed incorrect types!");
+
+    return expr_new_integer(exp->children[0]->count);
+}
+
+
+struct expr *builtin_init(Context *ctx, struct expr *exp) {
+
+    if (expr_type(exp->children[0]) != QEXP)
+        return expr_new_err("Function 'init' passed incorrect types!");
+
+    if (exp->children[0]->count == 0)
+        return expr_new_err("function 'init' passed '!");
+
+    struct expr *v = list_arg(exp);
+
+    return expr_slice(v, 0, v->count > 0 ? v->count - 1 : 0);
+}
+
+
+struct expr *builtin_head(Context *ctx, struct expr *exp) {
+
+    if (expr_type(exp->children[0]) != QEXP)
+        return expr_new_err("Function 'head' passed incorrect types!");
+
+    if (exp->children[0]->count == 0)
+        return expr_new_err("function 'head' passed '!");
+
+    struct expr *v = list_arg(exp);
+
+    return expr_slice(v, 0, v->count > 0 ? 1 : 0);
+}
+
+
+struct expr *builtin_last(Context *ctx, struct expr *exp) {
+
+    if (expr_type(exp->children[0]) != QEXP)
+        return expr_new_err("Function 'last' passed incorrect types!");
+
+    if (exp->children[0]->count == 0)
+        return expr_new_err("function 'last' passed '!");
+
+    struct expr *v = list_arg(exp);
+
+    return expr_slice(v, v->count > 0 ? v->count - 1 : 0, v->count);
+}
+
+
+struct expr *builtin_tail(Context *ctx, struct expr *exp) {
+
+    if (expr_type(exp->children[0]) != QEXP)
+        return expr_new_err("Function 'tail' passed incorrect types!");
+
+    if (exp->children[0]->count == 0)
+        return expr_new_err("Function 'tail' passed '!");
+
+    struct expr *v = list_arg(exp);
+
+    return expr_slice(v, v->count > 0 ? 1 : 0, v->count);
+}
+
+
+/* The list of arguments is built by the evaluator, it's ours to retag */
+struct expr *builtin_list(Context *ctx, struct expr *exp) {
+    exp->etype = QEXP;
+    return exp;
+}
+
+
+struct expr *builtin_eval(Context *ctx, struct expr *exp) {
+
+    if (expr_type(exp->children[0]) != QEXP)
+        return expr_new_err("Function 'eval' passed incorrect types!");
+
+    if (exp->children[0]->count == 0)
+        return exp->children[0];
+
+    struct expr *x = expr_peek(exp->children[0], 0);
+
+    if (expr_type(x) == QEXP) {
+        x = expr_slice(x, 0, x->count);
+        x->etype = SEXP;
     }
 
-    expr_integer(exp, exp->children[0]->count);
+    return eval(ctx, x);
+}
+
+
+/*
+ * (lambda 'x y) '(+ x y))) compiles a function of x and y, literal lambdas
+ * are compiled by the VM instead, so that they can see enclosing parameters
+ */
+struct expr *builtin_lambda(Context *ctx, struct expr *exp) {
 
+    if (expr_arg_count(exp) != 2)
+        return expr_new_err("Function 'lambda' passed incorrect types!");
+
+    return vm_lambda(ctx, exp->children[0], exp->children[1]);
+}
+
+
+/*
+ * (if c '(then)) '(else))) evaluates one of the branches, depending on c.
+ * Literal branches are compiled by the VM, only the one taken is run.
+ */
+struct expr *builtin_if(Context *ctx, struct expr *exp) {
+
+    if (expr_arg_count(exp) != 3 || expr_type(exp->children[1]) != QEXP
+        || expr_type(exp->children[2]) != QEXP)
+        return expr_new_err("Function 'if' passed incorrect types!");
+
+    struct expr *cond = exp->children[0];
+
+    if (expr_type(cond) == ERROR)
+        return cond;
+
+    return eval(ctx, expr_unquote(exp->children[expr_truthy(cond) ? 1 : 2]));
+}
+
+
+/* Keys are passed quoted, like the symbols of def, or as plain values */
+static struct expr *map_key_arg(struct expr *exp) {
+    if (exp && expr_type(exp) == QEXP && exp->count == 1)
+        exp = exp->children[0];
     return exp;
 }
 
 
-struct expr *builtin_init(Context *ctx, struct expr *exp) {
+/* Only called on maps still being built */
+static struct expr *map_put(struct expr *map,
+                            struct expr *key, struct expr *val) {
+
+    key = map_key_arg(key);
+
+    int status = key ? expr_map_put(map, key, val) : -HASHTABLE_ERR;
+
+    if (status == -HASHTABLE_ERR)
+        return expr_new_err("Map keys must be symbols, strings or integers!");
+
+    if (status != HASHTABLE_OK)
+        return expr_new_err("Out of memory");
+
+    return NULL;
+}
+
+
+/*
+ * (map '(k v) ...) or (map '((k v) ...)) builds a map out of a list of pairs,
+ * a lone pair isn't unwrapped
+ */
+struct expr *builtin_map(Context *ctx, struct expr *exp) {
+
+    if (expr_arg_count(exp) != 1 || arg_type(exp->children[0]) != QEXP)
+        return expr_new_err("Function 'map' passed incorrect types!");
+
+    struct expr *pairs = exp->children[0];
+    struct expr *map = expr_new_map();
 
-    if (exp->children[0]->etype != QEXP) {
-        expr_err(exp, "Function 'init' passed incorrect types!");
-        return exp;
+    if (expr_arg_count(pairs) == 1) {
+        struct expr *v = list_arg(exp);
+        int type = v->count > 0 ? arg_type(expr_peek(v, 0)) : -1;
+        if (v != pairs && (type == SEXP || type == QEXP))
+            pairs = v;
     }
 
-    if (exp->children[0]->count == 0) {
-        expr_err(exp, "function 'init' passed '!");
-        return exp;
+    int n = expr_arg_count(pairs);
+
+    for (int i = 0; i < n && expr_type(map) == MAP; i++) {
+
+        struct expr *p = pairs->children[i];
+
+        if ((expr_type(p) != SEXP && expr_type(p) != QEXP) || p->count != 2)
+            return expr_new_err("Function 'map' passed incorrect pairs!");
+
+        struct expr *err = map_put(map, p->children[0], p->children[1]);
+        if (err)
+            return err;
     }
 
-    /* Otherwise take first argument */
-    struct expr *v = expr_take(exp, 0);
+    return map;
+}
 
-    if (expr_peek(v, 0)->etype == SEXP || expr_peek(v, 0)->etype == QEXP)
-        v = expr_take(v, 0);
 
-    expr_del(expr_pop(v, 0));
+struct expr *builtin_map_get(Context *ctx, struct expr *exp) {
 
-    return v;
+    if (expr_arg_count(exp) != 2 || arg_type(exp->children[0]) != MAP)
+        return expr_new_err("Function 'map-get' passed incorrect types!");
+
+    struct expr *key = map_key_arg(exp->children[1]), *val;
+
+    if (!key || expr_map_get(exp->children[0], key, &val) != HASHTABLE_OK)
+        return expr_new_err("Map keys must be symbols, strings or integers!");
+
+    return val ? val : expr_new_err("Function 'map-get' key not found!");
 }
 
 
-struct expr *builtin_head(Context *ctx, struct expr *exp) {
+/* (map-put m k v ...) returns a new map, m is left untouched */
+struct expr *builtin_map_put(Context *ctx, struct expr *exp) {
+
+    int n = expr_arg_count(exp);
 
-    if (exp->children[0]->etype != QEXP) {
-        expr_err(exp, "Function 'head' passed incorrect types!");
-        return exp;
+    if (n < 3 || n % 2 == 0 || arg_type(exp->children[0]) != MAP)
+        return expr_new_err("Function 'map-put' passed incorrect types!");
+
+    struct expr *map = expr_map_copy(exp->children[0]);
+
+    for (int i = 1; i < n && expr_type(map) == MAP; i += 2) {
+        struct expr *err = map_put(map, exp->children[i],
+                                   exp->children[i + 1]);
+        if (err)
+            return err;
     }
 
-    if (exp->children[0]->count == 0) {
-        expr_err(exp, "function 'head' passed '!");
-        return exp;
+    return map;
+}
+
+
+/* (map-del m k ...) returns a new map, missing keys are ignored */
+struct expr *builtin_map_del(Context *ctx, struct expr *exp) {
+
+    int n = expr_arg_count(exp);
+
+    if (n < 2 || arg_type(exp->children[0]) != MAP)
+        return expr_new_err("Function 'map-del' passed incorrect types!");
+
+    struct expr *map = expr_map_copy(exp->children[0]);
+
+    for (int i = 1; i < n && expr_type(map) == MAP; i++) {
+        struct expr *key = map_key_arg(exp->children[i]);
+        if (!key || expr_map_del(map, key) != HASHTABLE_OK)
+            return expr_new_err("Map keys must be symbols, "
+                                "strings or integers!");
     }
 
-    /* Otherwise take first argument */
-    struct expr *v = expr_take(exp, 0);
+    return map;
+}
 
-    if (expr_peek(v, 0)->etype == SEXP || expr_peek(v, 0)->etype == QEXP)
-        v = expr_take(v, 0);
 
-    /* Delete all elements that are not head and return */
-    while (v->count > 1)
-        expr_del(expr_pop(v, 1));
+static int map_append_key(struct expr *key, struct expr *val, void *keys) {
+    (void) val;
+    expr_append(keys, key);
+    return HASHTABLE_OK;
+}
 
-    return v;
+
+struct expr *builtin_map_keys(Context *ctx, struct expr *exp) {
+
+    if (expr_arg_count(exp) != 1 || arg_type(exp->children[0]) != MAP)
+        return expr_new_err("Function 'map-keys' passed incorrect types!");
+
+    struct expr *keys = expr_new_qexp();
+
+    expr_map_each(exp->children[0], map_append_key, keys);
+
+    return keys;
 }
 
 
-struct expr *builtin_last(Context *ctx, struct expr *exp) {
+struct expr *builtin_map_size(Context *ctx, struct expr *exp) {
+
+    if (expr_arg_count(exp) != 1 || arg_type(exp->children[0]) != MAP)
+        return expr_new_err("Function 'map-size' passed incorrect types!");
+
+    return expr_new_integer(expr_map_size(exp->children[0]));
+}
+
+
+/*
+ * Check the arguments of a vector builtin: n vectors of the same length,
+ * followed by a number if scalar is set. Return an error or NULL.
+ */
+static struct expr *vector_args(struct expr *exp, const char *name,
+                                int n, bool scalar) {
+
+    char err[MAX_ERR_SIZE * 2];
+
+    if (expr_arg_count(exp) != n + scalar)
+        goto types;
+
+    for (int i = 0; i < n; i++)
+        if (arg_type(exp->children[i]) != VECTOR
+            || exp->children[i]->count != exp->children[0]->count)
+            goto types;
+
+    if (scalar && arg_type(exp->children[n]) != INTEGER
+        && arg_type(exp->children[n]) != DECIMAL)
+        goto types;
+
+    return NULL;
+
+types:
+    snprintf(err, sizeof(err), "Function '%s' passed incorrect types!", name);
+    return expr_new_err(err);
+}
+
+
+/* Elements of a vector as decimals, integers are converted in *tmp */
+static const double *vector_reals(struct expr *v, double **tmp) {
+
+    *tmp = NULL;
+
+    if (VECTOR(v)->decimal)
+        return VECTOR(v)->reals;
+
+    *tmp = malloc(v->count * sizeof(double));
+    for (int i = 0; i < v->count; i++)
+        (*tmp)[i] = (double) VECTOR(v)->ints[i];
+
+    return *tmp;
+}
+
+
+/* Sum of a, or of the products of a and b, too big for an int64_t */
+static struct expr *vector_dot_bigint(const int64_t *a,
+                                      const int64_t *b, int n) {
+
+    struct bigint acc, x, y;
 
-    if (exp->children[0]->etype != QEXP) {
-        expr_err(exp, "Function 'last' passed incorrect types!");
-        return exp;
+    bigint_init(&acc);
+    bigint_init(&x);
+    bigint_init(&y);
+
+    for (int i = 0; i < n; i++) {
+        bigint_set_ll(&x, a[i]);
+        if (b) {
+            bigint_set_ll(&y, b[i]);
+            bigint_mul(&x, &x, &y);
+        }
+        bigint_add(&acc, &acc, &x);
     }
 
-    if (exp->children[0]->count == 0) {
-        expr_err(exp, "function 'head' passed '!");
-        return exp;
+    struct expr *res = expr_new_bigint(&acc);
+
+    bigint_free(&y);
+    bigint_free(&x);
+    bigint_free(&acc);
+
+    return res;
+}
+
+
+/*
+ * (vector 1 2 3) or (vector '(1 2 3)), a vector of integers unless any of
+ * the numbers is a decimal
+ */
+struct expr *builtin_vector(Context *ctx, struct expr *exp) {
+
+    struct expr **items = exp->children;
+    int n = expr_arg_count(exp);
+    bool decimal = false;
+
+    if (n == 1 && arg_type(items[0]) == QEXP) {
+        struct expr *list = items[0];
+        /* A quoted form comes wrapped in a list, see list_arg */
+        if (expr_arg_count(list) == 1
+            && (expr_type(list->children[0]) == SEXP
+                || expr_type(list->children[0]) == QEXP))
+            list = list->children[0];
+        items = list->children;
+        n = expr_arg_count(list);
     }
 
-    struct expr *v = expr_take(exp, 0);
+    for (int i = 0; i < n; i++) {
+        if (arg_type(items[i]) == DECIMAL)
+            decimal = true;
+        else if (arg_type(items[i]) != INTEGER)
+            return expr_new_err("Function 'vector' passed incorrect types!");
+    }
 
-    if (expr_peek(v, 0)->etype == SEXP || expr_peek(v, 0)->etype == QEXP)
-        v = expr_take(v, 0);
+    struct expr *v = expr_new_vector(n, decimal);
 
-    while (v->count > 1)
-        expr_del(expr_pop(v, 0));
+    for (int i = 0; i < n; i++) {
+        if (!decimal)
+            VECTOR(v)->ints[i] = expr_ival(items[i]);
+        else if (expr_type(items[i]) == DECIMAL)
+            VECTOR(v)->reals[i] = items[i]->decimal;
+        else
+            VECTOR(v)->reals[i] = (double) expr_ival(items[i]);
+    }
 
     return v;
 }
 
 
-struct expr *builtin_tail(Context *ctx, struct expr *exp) {
+struct expr *builtin_vector_list(Context *ctx, struct expr *exp) {
+
+    struct expr *err = vector_args(exp, "vector-list", 1, false);
+    if (err)
+        return err;
+
+    struct expr *v = exp->children[0];
+    struct expr *list = expr_new_qexp();
+
+    for (int i = 0; i < v->count; i++)
+        expr_append(list, VECTOR(v)->decimal ?
+                    expr_new_decimal(VECTOR(v)->reals[i]) :
+                    expr_new_integer(VECTOR(v)->ints[i]));
+
+    return list;
+}
+
+
+struct expr *builtin_vector_sum(Context *ctx, struct expr *exp) {
+
+    struct expr *err = vector_args(exp, "vector-sum", 1, false);
+    if (err)
+        return err;
+
+    struct expr *v = exp->children[0];
+    int64_t sum;
+
+    if (VECTOR(v)->decimal)
+        return expr_new_decimal(simd_sum_reals(VECTOR(v)->reals, v->count));
+
+    if (simd_sum_ints(VECTOR(v)->ints, v->count, &sum))
+        return vector_dot_bigint(VECTOR(v)->ints, NULL, v->count);
+
+    return expr_new_integer(sum);
+}
+
 
-    if (exp->children[0]->etype != QEXP) {
-        expr_err(exp, "Function 'tail' passed incorrect types!");
-        return exp;
+struct expr *builtin_vector_dot(Context *ctx, struct expr *exp) {
+
+    struct expr *err = vector_args(exp, "vector-dot", 2, false);
+    if (err)
+        return err;
+
+    struct expr *a = exp->children[0], *b = exp->children[1];
+    long long dot = 0, x;
+
+    /* No 64 bits multiplication in SIMD below AVX-512, integers are checked */
+    if (!VECTOR(a)->decimal && !VECTOR(b)->decimal) {
+        for (int i = 0; i < a->count; i++)
+            if (checked_mul(VECTOR(a)->ints[i], VECTOR(b)->ints[i], &x)
+                || checked_add(dot, x, &dot))
+                return vector_dot_bigint(VECTOR(a)->ints,
+                                         VECTOR(b)->ints, a->count);
+        return expr_new_integer(dot);
     }
 
-    if (exp->children[0]->count == 0) {
-        expr_err(exp, "Function 'tail' passed '!");
-        return exp;
+    double *ta, *tb;
+    const double *ra = vector_reals(a, &ta), *rb = vector_reals(b, &tb);
+    double d = simd_dot_reals(ra, rb, a->count);
+
+    free(ta);
+    free(tb);
+
+    return expr_new_decimal(d);
+}
+
+
+static struct expr *vector_extreme(struct expr *exp,
+                                   const char *name, bool max) {
+
+    struct expr *err = vector_args(exp, name, 1, false);
+    if (err)
+        return err;
+
+    struct expr *v = exp->children[0];
+
+    if (v->count == 0) {
+        char msg[MAX_ERR_SIZE];
+        snprintf(msg, sizeof(msg), "Function '%s' passed an empty vector!",
+                 name);
+        return expr_new_err(msg);
     }
 
-    struct expr *v = expr_take(exp, 0);
+    if (VECTOR(v)->decimal)
+        return expr_new_decimal(max ?
+                                simd_max_reals(VECTOR(v)->reals, v->count) :
+                                simd_min_reals(VECTOR(v)->reals, v->count));
+
+    return expr_new_integer(max ? simd_max_ints(VECTOR(v)->ints, v->count) :
+                            simd_min_ints(VECTOR(v)->ints, v->count));
+}
+
+
+struct expr *builtin_vector_min(Context *ctx, struct expr *exp) {
+    return vector_extreme(exp, "vector-min", false);
+}
+
+
+struct expr *builtin_vector_max(Context *ctx, struct expr *exp) {
+    return vector_extreme(exp, "vector-max", true);
+}
+
 
-    if (expr_peek(v, 0)->etype == SEXP || expr_peek(v, 0)->etype == QEXP)
-        v = expr_take(v, 0);
+/* Element-wise sum or product, decimal if any of the two is */
+static struct expr *vector_map(struct expr *exp, const char *name, char op) {
+
+    struct expr *err = vector_args(exp, name, 2, false);
+    if (err)
+        return err;
+
+    struct expr *a = exp->children[0], *b = exp->children[1];
+    bool decimal = VECTOR(a)->decimal || VECTOR(b)->decimal;
+    struct expr *v = expr_new_vector(a->count, decimal);
+    bool overflow = false;
+
+    if (!decimal && op == '+') {
+        overflow = simd_add_ints(VECTOR(v)->ints, VECTOR(a)->ints,
+                                 VECTOR(b)->ints, a->count);
+    } else if (!decimal) {
+        long long x;
+        for (int i = 0; i < a->count; i++) {
+            overflow |= checked_mul(VECTOR(a)->ints[i], VECTOR(b)->ints[i],
+                                    &x);
+            VECTOR(v)->ints[i] = x;
+        }
+    } else {
+        double *ta, *tb;
+        const double *ra = vector_reals(a, &ta), *rb = vector_reals(b, &tb);
+        if (op == '+')
+            simd_add_reals(VECTOR(v)->reals, ra, rb, a->count);
+        else
+            simd_mul_reals(VECTOR(v)->reals, ra, rb, a->count);
+        free(ta);
+        free(tb);
+    }
+
+    /* Elements are 64 bits integers, there's nothing to promote them to */
+    return overflow ? expr_new_err(ERR_INT_OVERFLOW) : v;
+}
 
-    expr_del(expr_pop(v, 0));
+
+struct expr *builtin_vector_add(Context *ctx, struct expr *exp) {
+    return vector_map(exp, "vector-add", '+');
+}
+
+
+struct expr *builtin_vector_mul(Context *ctx, struct expr *exp) {
+    return vector_map(exp, "vector-mul", '*');
+}
+
+
+/* (vector-scale v k), decimal if either v or k is */
+struct expr *builtin_vector_scale(Context *ctx, struct expr *exp) {
+
+    struct expr *err = vector_args(exp, "vector-scale", 1, true);
+    if (err)
+        return err;
+
+    struct expr *a = exp->children[0], *k = exp->children[1];
+    bool decimal = VECTOR(a)->decimal || expr_type(k) == DECIMAL;
+    struct expr *v = expr_new_vector(a->count, decimal);
+
+    if (!decimal) {
+        long long x;
+        for (int i = 0; i < a->count; i++) {
+            if (checked_mul(VECTOR(a)->ints[i], expr_ival(k), &x))
+                return expr_new_err(ERR_INT_OVERFLOW);
+            VECTOR(v)->ints[i] = x;
+        }
+        return v;
+    }
+
+    double *ta;
+    const double *ra = vector_reals(a, &ta);
+
+    simd_scale_reals(VECTOR(v)->reals, ra, expr_type(k) == DECIMAL ?
+                     k->decimal : (double) expr_ival(k), a->count);
+    free(ta);
 
     return v;
 }
 
 
-struct expr *builtin_list(Context *ctx, struct expr *exp) {
-    exp->etype = QEXP;
-    return exp;
+static inline bool seq_callable(struct expr *fn) {
+    return arg_type(fn) == LAMBDA || arg_type(fn) == FUNCTION;
 }
 
 
-struct expr *builtin_eval(Context *ctx, struct expr *exp) {
+/* Sequences pull from another sequence or from the items of a list */
+static struct expr *seq_source(struct expr *src) {
+
+    if (arg_type(src) == SEQ)
+        return src;
 
-    if (exp->children[0]->etype != QEXP) {
-        expr_err(exp, "Function 'eval' passed incorrect types!");
-        return exp;
+    if (arg_type(src) != QEXP)
+        return NULL;
+
+    /* A quoted form comes wrapped in a list, see list_arg */
+    if (expr_arg_count(src) == 1
+        && (expr_type(src->children[0]) == SEXP
+            || expr_type(src->children[0]) == QEXP))
+        src = src->children[0];
+
+    return src;
+}
+
+
+/* (range end), (range start end) or (range start end step), end excluded */
+struct expr *builtin_range(Context *ctx, struct expr *exp) {
+
+    long long bounds[3] = { 0, 0, 1 };
+    int n = expr_arg_count(exp);
+
+    if (n < 1 || n > 3)
+        return expr_new_err("Function 'range' passed incorrect types!");
+
+    for (int i = 0; i < n; i++) {
+        if (arg_type(exp->children[i]) != INTEGER)
+            return expr_new_err("Function 'range' passed incorrect types!");
+        bounds[n == 1 ? 1 : i] = expr_ival(exp->children[i]);
     }
 
-    struct expr *x = expr_take(expr_take(exp, 0), 0);
-    x->etype = SEXP;
+    if (bounds[2] == 0)
+        return expr_new_err("Function 'range' passed a zero step!");
 
-    return eval(ctx, x);
+    return expr_new_range(bounds[0], bounds[1], bounds[2]);
+}
+
+
+/* (lmap f s), (lfilter f s) and (take n s) only wrap s in a new stage */
+static struct expr *seq_stage(struct expr *exp, const char *name,
+                              seqkind kind) {
+
+    char err[MAX_ERR_SIZE * 2];
+
+    if (expr_arg_count(exp) == 2) {
+        struct expr *arg = exp->children[0];
+        struct expr *src = seq_source(exp->children[1]);
+        bool valid = kind == SEQ_TAKE ? arg_type(arg) == INTEGER
+            && expr_ival(arg) >= 0 : seq_callable(arg);
+        if (src && valid)
+            return expr_new_seq(kind, arg, src);
+    }
+
+    snprintf(err, sizeof(err), "Function '%s' passed incorrect types!", name);
+    return expr_new_err(err);
+}
+
+
+struct expr *builtin_lmap(Context *ctx, struct expr *exp) {
+    return seq_stage(exp, "lmap", SEQ_MAP);
+}
+
+
+struct expr *builtin_lfilter(Context *ctx, struct expr *exp) {
+    return seq_stage(exp, "lfilter", SEQ_FILTER);
+}
+
+
+struct expr *builtin_take(Context *ctx, struct expr *exp) {
+    return seq_stage(exp, "take", SEQ_TAKE);
+}
+
+
+/* Operator of an arithmetic builtin, 0 for any other function */
+static char seq_arith_op(struct expr *fn) {
+
+    if (expr_type(fn) != FUNCTION)
+        return 0;
+
+    if (fn->fn == builtin_add)
+        return '+';
+    if (fn->fn == builtin_sub)
+        return '-';
+    if (fn->fn == builtin_mul)
+        return '*';
+    if (fn->fn == builtin_div)
+        return '/';
+    if (fn->fn == builtin_mod)
+        return '%';
+
+    return 0;
+}
+
+
+/*
+ * (reduce f init s), fold the elements of a sequence or of a list as they're
+ * pulled. Arithmetic builtins are folded in place, like the VM does, with no
+ * argument list built for every element.
+ */
+struct expr *builtin_reduce(Context *ctx, struct expr *exp) {
+
+    if (expr_arg_count(exp) != 3 || !seq_callable(exp->children[0])
+        || !exp->children[1] || !seq_source(exp->children[2]))
+        return expr_new_err("Function 'reduce' passed incorrect types!");
+
+    struct expr *fn = exp->children[0];
+    struct expr *acc = exp->children[1], *x;
+    char op = seq_arith_op(fn);
+    struct seq_iter it;
+
+    seq_iter_init(&it, ctx, seq_source(exp->children[2]));
+
+    for (;;) {
+        gc_push_root(acc);
+        x = seq_iter_next(&it);
+        gc_pop_root();
+        if (!x || expr_type(x) == ERROR)
+            break;
+        struct expr *args[2] = { acc, x };
+        acc = op ? builtin_arith(args, 2, op) : vm_funcall(ctx, fn, args, 2);
+        if (!acc || expr_type(acc) == ERROR)
+            break;
+    }
+
+    seq_iter_release(&it);
+
+    return x && expr_type(x) == ERROR ? x : acc;
 }
 
 
-struct expr *builtin_integer_op(struct expr *exp, char operator,
-                                long long num1, long long num2) {
+/*
+ * Sum of n fixnums, the tagged words go through the vector kernel as they
+ * are. Words are 2 * v + 1, their total has the parity of n and halving it
+ * gives the sum. Return true if the total of the words doesn't fit, the
+ * caller starts over on bigints: it only happens past 2^62.
+ */
+static bool fixnum_sum(struct expr **args, int n, long long *sum) {
+
+    int64_t total;
+
+    /* Words are read as int64_t, only where pointers are that wide */
+    if (sizeof(*args) != sizeof(int64_t)) {
+        *sum = 0;
+        for (int i = 0; i < n; i++)
+            if (checked_add(*sum, FIXNUM_VAL(args[i]), sum))
+                return true;
+        return false;
+    }
+
+    if (simd_sum_ints((const int64_t *) args, n, &total))
+        return true;
+
+    /* (total - n) / 2, without overflowing near the bounds */
+    *sum = (long long) ((total >> 1) - (n >> 1));
+
+    return false;
+}
+
+
+/*
+ * Integers that don't fit a long long, as operands or as results, are folded
+ * on an arbitrary precision accumulator. Results that fit are demoted back.
+ */
+static struct expr *arith_bigints(struct expr **args, int n, char operator) {
+
+    struct bigint acc, x;
+    struct expr *res = NULL;
+
+    bigint_init(&acc);
+    bigint_init(&x);
+    expr_get_bigint(args[0], &acc);
+
+    /* Unary minus, zero is never negative */
+    if (operator == '-' && n == 1)
+        acc.negative = !acc.negative && acc.size > 0;
+
+    for (int i = 1; i < n && !res; i++) {
+        expr_get_bigint(args[i], &x);
+        switch (operator) {
+            case '+':
+                bigint_add(&acc, &acc, &x);
+                break;
+            case '-':
+                bigint_sub(&acc, &acc, &x);
+                break;
+            case '*':
+                bigint_mul(&acc, &acc, &x);
+                break;
+            case '/':
+                if (bigint_divmod(&acc, NULL, &acc, &x) < 0)
+                    res = expr_new_err(ERR_DIV_BY_ZERO);
+                break;
+            case '%':
+                if (bigint_divmod(NULL, &acc, &acc, &x) < 0)
+                    res = expr_new_err(ERR_DIV_BY_ZERO);
+                break;
+            default:
+                res = expr_new_err(ERR_INVALID_INT_OP);
+                break;
+        }
+    }
+
+    if (!res)
+        res = expr_new_bigint(&acc);
+
+    bigint_free(&x);
+    bigint_free(&acc);
+
+    return res;
+}
+
+
+/*
+ * All operands are integers, the operator is dispatched once. The fold is
+ * started over on bigints as soon as the result overflows.
+ */
+static struct expr *arith_integers(struct expr **args, int n,
+                                   char operator, bool fixnums) {
+
+    long long acc = n > 0 ? expr_ival(args[0]) : 0;
+    long long x;
+    struct expr *err = NULL;
+
+    if (operator == '-' && n == 1) {
+        if (checked_sub(0, acc, &acc))
+            return arith_bigints(args, n, operator);
+        return expr_new_integer(acc);
+    }
 
     switch (operator) {
         case '+':
-            expr_integer(exp, num1 + num2);
+            if (fixnums)
+                return fixnum_sum(args, n, &x) ?
+                    arith_bigints(args, n, operator) : expr_new_integer(x);
+            for (int i = 1; i < n; i++)
+                if (checked_add(acc, expr_ival(args[i]), &acc))
+                    return arith_bigints(args, n, operator);
             break;
         case '-':
-            expr_integer(exp, num1 - num2);
+            if (fixnums && n > 1) {
+                if (fixnum_sum(args + 1, n - 1, &x)
+                    || checked_sub(acc, x, &acc))
+                    return arith_bigints(args, n, operator);
+                break;
+            }
+            for (int i = 1; i < n; i++)
+                if (checked_sub(acc, expr_ival(args[i]), &acc))
+                    return arith_bigints(args, n, operator);
             break;
         case '*':
-            expr_integer(exp, num1 * num2);
+            for (int i = 1; i < n; i++)
+                if (checked_mul(acc, expr_ival(args[i]), &acc))
+                    return arith_bigints(args, n, operator);
             break;
+        default:
+            for (int i = 1; i < n && !err; i++) {
+                x = expr_ival(args[i]);
+                if (operator == '/' && acc == LLONG_MIN && x == -1)
+                    return arith_bigints(args, n, operator);
+                err = builtin_integer_op(operator, &acc, x);
+            }
+            break;
+    }
+
+    return err ? err : expr_new_integer(acc);
+}
+
+
+/* All operands are decimals, the operator is dispatched once */
+static struct expr *arith_decimals(struct expr **args, int n, char operator) {
+
+    double acc = args[0]->decimal;
+    struct expr *err = NULL;
+
+    if (operator == '-' && n == 1)
+        return expr_new_decimal(-acc);
+
+    switch (operator) {
+        case '+':
+            for (int i = 1; i < n; i++)
+                acc += args[i]->decimal;
+            break;
+        case '-':
+            for (int i = 1; i < n; i++)
+                acc -= args[i]->decimal;
+            break;
+        case '*':
+            for (int i = 1; i < n; i++)
+                acc *= args[i]->decimal;
+            break;
+        default:
+            for (int i = 1; i < n && !err; i++)
+                err = builtin_decimal_op(operator, &acc, args[i]->decimal);
+            break;
+    }
+
+    return err ? err : expr_new_decimal(acc);
+}
+
+
+/* True if folding num into acc with the operator doesn't fit a long long */
+static inline bool integer_overflows(char operator,
+                                     long long acc, long long num) {
+    long long r;
+
+    switch (operator) {
+        case '+':
+            return checked_add(acc, num, &r);
+        case '-':
+            return checked_sub(acc, num, &r);
+        case '*':
+            return checked_mul(acc, num, &r);
         case '/':
-            if (num2 == 0) {
+            return acc == LLONG_MIN && num == -1;
+        default:
+            return false;
+    }
+}
+
+
+/* Value of any number as a decimal */
+static double expr_dval(const struct expr *exp) {
+
+    if (expr_type(exp) == DECIMAL)
+        return exp->decimal;
+
+    if (expr_type(exp) == INTEGER)
+        return expr_ival(exp);
+
+    struct bigint b;
+    bigint_init(&b);
+    expr_get_bigint(exp, &b);
+    double x = bigint_to_double(&b);
+    bigint_free(&b);
+
+    return x;
+}
+
+
+/*
+ * Fold all operands into an accumulator, promoting it to decimal as soon as a
+ * decimal or a bigint operand is met, or the integer fold would overflow.
+ * Only the final result gets materialized.
+ */
+static struct expr *arith_mixed(struct expr **args, int count, char operator) {
+
+    long long iacc = 0;
+    double dacc = 0.0;
+    bool decimal = false;
+    int operands = 0;
+    struct expr *err = NULL;
+
+    for (int i = 0; i < count && !err; i++) {
+
+        struct expr *y = args[i];
+
+        if (!y || expr_type(y) == SEXP_END)
+            continue;
+
+        bool overflow = !decimal && operands > 0 && expr_type(y) == INTEGER
+            && integer_overflows(operator, iacc, expr_ival(y));
+
+        if (!decimal && (expr_type(y) != INTEGER || overflow)) {
+            decimal = true;
+            dacc = (double) iacc;
+        }
+
+        if (operands++ == 0) {
+            if (decimal)
+                dacc = expr_dval(y);
+            else
+                iacc = expr_ival(y);
+            continue;
+        }
+
+        if (decimal)
+            err = builtin_decimal_op(operator, &dacc, expr_dval(y));
+        else
+            err = builtin_integer_op(operator, &iacc, expr_ival(y));
+    }
+
+    if (err)
+        return err;
+
+    /* Unary minus */
+    if (operator == '-' && operands == 1) {
+        if (!decimal && checked_sub(0, iacc, &iacc))
+            return expr_new_err(ERR_INT_OVERFLOW);
+        dacc = -dacc;
+    }
+
+    return decimal ? expr_new_decimal(dacc) : expr_new_integer(iacc);
+}
+
+
+static struct expr *arith_types(char operator) {
+    char err[MAX_ERR_SIZE];
+    snprintf(err, sizeof(err),
+             "Function '%c' passed incorrect types!", operator);
+    return expr_new_err(err);
+}
+
+
+/*
+ * Fold a run of operands with an arithmetic operator, an error is returned if
+ * any of them isn't a number. Called by the arithmetic builtins and directly
+ * by the VM, on the operands sitting on its stack.
+ *
+ * Operands are sorted out in a single pass first, lists of integers only or
+ * of decimals only are folded by a loop specialized on the operator, any
+ * other mix by the generic one.
+ */
+struct expr *builtin_arith(struct expr **args, int count, char operator) {
+
+    int fixnums = 0, integers = 0, bigints = 0, decimals = 0;
+    struct expr *err = NULL;
+
+    for (int i = 0; i < count; i++) {
+
+        struct expr *y = args[i];
+
+        if (IS_FIXNUM(y)) {
+            fixnums++;
+            continue;
+        }
+
+        if (!y)
+            continue;
+
+        switch (expr_type(y)) {
+            case INTEGER:
+                integers++;
+                break;
+            case DECIMAL:
+                decimals++;
+                break;
+            case ERROR:
+                if (!err)
+                    err = y;
+                break;
+            case SEXP_END:
+                break;
+            default:
+                /* Kept out of the cases, the fixnum loop stays tight */
+                if (expr_type(y) != BIGINT)
+                    return arith_types(operator);
+                bigints++;
+                break;
+        }
+    }
+
+    if (err)
+        return err;
+
+    /* Top level forms keep the end markers of the parser */
+    while (count > 0 && (!args[count - 1]
+                         || expr_type(args[count - 1]) == SEXP_END))
+        count--;
+
+    integers += fixnums;
+
+    if (integers == count)
+        return arith_integers(args, count, operator, fixnums == count);
+
+    if (integers + bigints == count)
+        return arith_bigints(args, count, operator);
+
+    if (decimals == count)
+        return arith_decimals(args, count, operator);
+
+    return arith_mixed(args, count, operator);
+}
+
+
+struct expr *builtin_add(Context *ctx, struct expr *exp) {
+    return builtin_arith(exp->children, exp->count, '+');
+}
+
+
+struct expr *builtin_sub(Context *ctx, struct expr *exp) {
+    return builtin_arith(exp->children, exp->count, '-');
+}
+
+
+struct expr *builtin_mul(Context *ctx, struct expr *exp) {
+    return builtin_arith(exp->children, exp->count, '*');
+}
+
+
+struct expr *builtin_div(Context *ctx, struct expr *exp) {
+    return builtin_arith(exp->children, exp->count, '/');
+}
+
+
+struct expr *builtin_mod(Context *ctx, struct expr *exp) {
+    return builtin_arith(exp->children, exp->count, '%');
+}
+
+
+/*
+ * Arithmetic helpers work on an accumulator, so that builtin_arith can fold an
+ * entire list of operands without allocating any intermediate result. A new
+ * ERROR expression is returned on failure, NULL otherwise.
+ */
+struct expr *builtin_integer_op(char operator, long long *acc, long long num) {
+
+    switch (operator) {
+        case '+':
+            if (checked_add(*acc, num, acc))
+                return expr_new_err(ERR_INT_OVERFLOW);
+            break;
+        case '-':
+            if (checked_sub(*acc, num, acc))
+                return expr_new_err(ERR_INT_OVERFLOW);
+            break;
+        case '*':
+            if (checked_mul(*acc, num, acc))
+                return expr_new_err(ERR_INT_OVERFLOW);
+            break;
+        case '/':
+            if (num == 0) {
                 char err[MAX_ERR_SIZE];
-                sprintf(err, "%s -> %lld / %lld", ERR_DIV_BY_ZERO, num1, num2);
-                expr_err(exp, err);
+                sprintf(err, "%s -> %lld / %lld", ERR_DIV_BY_ZERO, *acc, num);
+                return expr_new_err(err);
             }
-            else
-                expr_integer(exp, num1 / num2);
+            if (*acc == LLONG_MIN && num == -1)
+                return expr_new_err(ERR_INT_OVERFLOW);
+            *acc /= num;
             break;
         case '%':
-            expr_integer(exp, num1 % num2);
+            if (num == 0) {
+                char err[MAX_ERR_SIZE];
+                sprintf(err, "%s -> %lld %% %lld", ERR_DIV_BY_ZERO, *acc, num);
+                return expr_new_err(err);
+            }
+            *acc = num == -1 ? 0 : *acc % num;
             break;
         default:
-            expr_err(exp, ERR_INVALID_INT_OP);
-            break;
+            return expr_new_err(ERR_INVALID_INT_OP);
     }
 
-    return exp;
+    return NULL;
 }
 
 
-struct expr *builtin_decimal_op(struct expr *exp, char operator,
-                                double num1, double num2) {
+struct expr *builtin_decimal_op(char operator, double *acc, double num) {
 
     switch (operator) {
         case '+':
-            expr_decimal(exp, num1 + num2);
+            *acc += num;
             break;
         case '-':
-            expr_decimal(exp, num1 - num2);
+            *acc -= num;
             break;
         case '*':
-            expr_decimal(exp, num1 * num2);
+            *acc *= num;
             break;
         case '/':
-            if (num2 == 0.0000) {
+            if (num == 0.0000) {
                 char err[MAX_ERR_SIZE];
-                sprintf(err, "%s -> %lf / %lf", ERR_DIV_BY_ZERO, num1, num2);
-                expr_err(exp, err);
+                sprintf(err, "%s -> %lf / %lf", ERR_DIV_BY_ZERO, *acc, num);
+                return expr_new_err(err);
             }
-            else
-                expr_decimal(exp, num1 / num2);
+            *acc /= num;
             break;
         default:
-            expr_err(exp, ERR_INVALID_DEC_OP);
-            break;
+            return expr_new_err(ERR_INVALID_DEC_OP);
     }
 
-    return exp;
+    return NULL;
 }
@@ -48,9 +48,65 @@ struct expr *builtin_list(Context *, struct expr *);
 
 struct expr *builtin_eval(Context *, struct expr *);
 
-struct expr *builtin_integer_op(struct expr *, char, long long, long long);
+struct expr *builtin_lambda(Context *, struct expr *);
 
-struct expr *builtin_decimal_op(struct expr *, char, double, double);
+struct expr *builtin_if(Context *, struct expr *);
+
+struct expr *builtin_map(Context *, struct expr *);
+
+struct expr *builtin_map_get(Context *, struct expr *);
+
+struct expr *builtin_map_put(Context *, struct expr *);
+
+struct expr *builtin_map_del(Context *, struct expr *);
+
+struct expr *builtin_map_keys(Context *, struct expr *);
+
+struct expr *builtin_map_size(Context *, struct expr *);
+
+struct expr *builtin_vector(Context *, struct expr *);
+
+struct expr *builtin_vector_list(Context *, struct expr *);
+
+struct expr *builtin_vector_sum(Context *, struct expr *);
+
+struct expr *builtin_vector_dot(Context *, struct expr *);
+
+struct expr *builtin_vector_min(Context *, struct expr *);
+
+struct expr *builtin_vector_max(Context *, struct expr *);
+
+struct expr *builtin_vector_add(Context *, struct expr *);
+
+struct expr *builtin_vector_mul(Context *, struct expr *);
+
+struct expr *builtin_vector_scale(Context *, struct expr *);
+
+struct expr *builtin_range(Context *, struct expr *);
+
+struct expr *builtin_lmap(Context *, struct expr *);
+
+struct expr *builtin_lfilter(Context *, struct expr *);
+
+struct expr *builtin_take(Context *, struct expr *);
+
+struct expr *builtin_reduce(Context *, struct expr *);
+
+struct expr *builtin_add(Context *, struct expr *);
+
+struct expr *builtin_sub(Context *, struct expr *);
+
+struct expr *builtin_mul(Context *, struct expr *);
+
+struct expr *builtin_div(Context *, struct expr *);
+
+struct expr *builtin_mod(Context *, struct expr *);
+
+struct expr *builtin_arith(struct expr **, int, char);
+
+struct expr *builtin_integer_op(char, long long *, long long);
+
+struct expr *builtin_decimal_op(char, double *, double);
 
 
 #endif
@@ -0,0 +1,554 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "chashtable.h"
+
+
+/* Never less buckets than stripes, a bucket is always under a single lock */
+#define CHT_INITIAL_SIZE    CHT_STRIPES
+
+/* Retired objects between two attempts to release them */
+#define CHT_COLLECT_EVERY   64
+
+
+/*
+ * Epoch based reclamation. Readers publish the global epoch they run in, and
+ * 0 once done. The epoch is only advanced when all the running readers have
+ * seen the current one, so anything unlinked during epoch e can't be reached
+ * anymore once the global epoch is e + 2.
+ */
+struct cht_thread {
+    atomic_bool used;
+    atomic_uint_fast64_t epoch;
+    unsigned depth;             /* Nested reads, only touched by the owner */
+};
+
+
+static struct cht_thread threads[CHT_MAX_THREADS];
+
+static atomic_uint_fast64_t global_epoch = 1;
+
+static _Thread_local struct cht_thread *self;
+
+static pthread_key_t self_key;
+
+static pthread_once_t self_once = PTHREAD_ONCE_INIT;
+
+/* Signaled whenever a slot is given back */
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_cond_t slots_freed = PTHREAD_COND_INITIALIZER;
+
+
+/* Things that can't be released while readers may still be looking at them */
+struct cht_retired {
+    struct cht_retired *next;
+    uint_fast64_t epoch;
+    enum { CHT_NODE, CHT_ENTRY, CHT_BUCKETS } kind;
+    void *ptr;
+};
+
+
+/* Give the slot back when the thread exits, waking up a thread waiting */
+static void cht_thread_exit(void *arg) {
+    struct cht_thread *t = arg;
+    atomic_store(&t->epoch, 0);
+    pthread_mutex_lock(&slots_lock);
+    atomic_store(&t->used, false);
+    pthread_cond_signal(&slots_freed);
+    pthread_mutex_unlock(&slots_lock);
+}
+
+
+static void cht_key_init(void) {
+    pthread_key_create(&self_key, cht_thread_exit);
+}
+
+
+/* Slot of the calling thread, taken on first use */
+static struct cht_thread *cht_self(void) {
+
+    if (self)
+        return self;
+
+    pthread_once(&self_once, cht_key_init);
+
+    /* With all the slots taken, sleep until a thread exits */
+    pthread_mutex_lock(&slots_lock);
+
+    while (!self) {
+        for (int i = 0; i < CHT_MAX_THREADS && !self; i++) {
+            bool expected = false;
+            if (atomic_compare_exchange_strong(&threads[i].used,
+                                               &expected, true))
+                self = &threads[i];
+        }
+        if (!self)
+            pthread_cond_wait(&slots_freed, &slots_lock);
+    }
+
+    pthread_mutex_unlock(&slots_lock);
+
+    pthread_setspecific(self_key, self);
+
+    return self;
+}
+
+
+static struct cht_thread *cht_enter(void) {
+
+    struct cht_thread *t = cht_self();
+
+    if (t->depth++ == 0)
+        atomic_store(&t->epoch, atomic_load(&global_epoch));
+
+    return t;
+}
+
+
+static void cht_exit(struct cht_thread *t) {
+    if (--t->depth == 0)
+        atomic_store_explicit(&t->epoch, 0, memory_order_release);
+}
+
+
+/* Release retired objects, the destructor is only called for deleted entries */
+static void cht_free(CHashTable *table, struct cht_retired *r) {
+
+    switch (r->kind) {
+        case CHT_ENTRY:
+            table->destructor(&((struct cht_node *) r->ptr)->entry);
+            free(r->ptr);
+            break;
+        case CHT_NODE:
+            free(r->ptr);
+            break;
+        case CHT_BUCKETS: {
+            /* Nodes were copied to the new buckets, entries live on there */
+            struct cht_buckets *b = r->ptr;
+            for (size_t i = 0; i < b->size; i++) {
+                struct cht_node *n = atomic_load(&b->heads[i]);
+                while (n) {
+                    struct cht_node *next = atomic_load(&n->next);
+                    free(n);
+                    n = next;
+                }
+            }
+            free(b);
+            break;
+        }
+    }
+
+    free(r);
+}
+
+
+/* Try to advance the epoch, then release what no reader can see anymore */
+static void cht_collect(CHashTable *table) {
+
+    uint_fast64_t epoch = atomic_load(&global_epoch);
+    bool quiescent = true;
+
+    for (int i = 0; i < CHT_MAX_THREADS && quiescent; i++) {
+        if (!atomic_load(&threads[i].used))
+            continue;
+        uint_fast64_t e = atomic_load(&threads[i].epoch);
+        quiescent = e == 0 || e == epoch;
+    }
+
+    if (quiescent)
+        atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+
+    epoch = atomic_load(&global_epoch);
+
+    struct cht_retired *expired = NULL;
+
+    pthread_mutex_lock(&table->limbo_lock);
+
+    struct cht_retired **link = &table->limbo;
+    while (*link) {
+        struct cht_retired *r = *link;
+        if (r->epoch + 2 <= epoch) {
+            *link = r->next;
+            r->next = expired;
+            expired = r;
+        } else {
+            link = &r->next;
+        }
+    }
+
+    pthread_mutex_unlock(&table->limbo_lock);
+
+    while (expired) {
+        struct cht_retired *next = expired->next;
+        cht_free(table, expired);
+        expired = next;
+    }
+}
+
+
+/* Called once ptr is unlinked, so it's tagged with an epoch seen after it */
+static void cht_retire(CHashTable *table, void *ptr, int kind) {
+
+    struct cht_retired *r = malloc(sizeof(*r));
+
+    /* Leak it rather than risk a reader using it after a free */
+    if (!r)
+        return;
+
+    r->ptr = ptr;
+    r->kind = kind;
+    r->epoch = atomic_load(&global_epoch);
+
+    pthread_mutex_lock(&table->limbo_lock);
+    r->next = table->limbo;
+    table->limbo = r;
+    bool collect = ++table->retired % CHT_COLLECT_EVERY == 0;
+    pthread_mutex_unlock(&table->limbo_lock);
+
+    if (collect)
+        cht_collect(table);
+}
+
+
+static struct cht_buckets *cht_buckets_alloc(size_t size) {
+
+    struct cht_buckets *b = malloc(sizeof(*b) + size * sizeof(b->heads[0]));
+    if (!b)
+        return NULL;
+
+    b->size = size;
+    for (size_t i = 0; i < size; i++)
+        atomic_init(&b->heads[i], NULL);
+
+    return b;
+}
+
+
+static inline pthread_mutex_t *cht_lock(CHashTable *table, uint64_t hash) {
+    return &table->locks[hash & (CHT_STRIPES - 1)];
+}
+
+
+/*
+ * Double the buckets, keeping the load under 1. Nodes are copied instead of
+ * relinked, readers may still be walking the old chains. Readers go on while
+ * the buckets are rebuilt, writers wait.
+ */
+static void cht_grow(CHashTable *table) {
+
+    for (int i = 0; i < CHT_STRIPES; i++)
+        pthread_mutex_lock(&table->locks[i]);
+
+    struct cht_buckets *old = atomic_load(&table->buckets);
+    struct cht_buckets *b = NULL;
+
+    /* Someone else got here first */
+    if (atomic_load(&table->size) <= old->size)
+        goto unlock;
+
+    b = cht_buckets_alloc(2 * old->size);
+    if (!b)
+        goto unlock;
+
+    for (size_t i = 0; i < old->size; i++) {
+        struct cht_node *n = atomic_load_explicit(&old->heads[i],
+                                                  memory_order_relaxed);
+        for (; n; n = atomic_load_explicit(&n->next, memory_order_relaxed)) {
+
+            struct cht_node *copy = malloc(sizeof(*copy));
+
+            /* Keep the old buckets, the new ones are dropped */
+            if (!copy) {
+                old = b;
+                goto unlock;
+            }
+
+            size_t j = n->entry.hash & (b->size - 1);
+            copy->entry = n->entry;
+            atomic_init(&copy->next, atomic_load(&b->heads[j]));
+            atomic_init(&b->heads[j], copy);
+        }
+    }
+
+    atomic_store_explicit(&table->buckets, b, memory_order_release);
+
+unlock:
+
+    for (int i = CHT_STRIPES - 1; i >= 0; i--)
+        pthread_mutex_unlock(&table->locks[i]);
+
+    if (b)
+        cht_retire(table, old, CHT_BUCKETS);
+}
+
+
+/* Same default as the HashTable, keys and values are freed */
+static int cht_destroy_entry(struct ht_entry *entry) {
+    free((void *) entry->key);
+    free(entry->val);
+    return HASHTABLE_OK;
+}
+
+
+CHashTable *chashtable_create(ht_unary_fun *destructor) {
+
+    CHashTable *table = malloc(sizeof(CHashTable));
+    if (!table)
+        return NULL;
+
+    struct cht_buckets *b = cht_buckets_alloc(CHT_INITIAL_SIZE);
+    if (!b) {
+        free(table);
+        return NULL;
+    }
+
+    table->seed = hashtable_seed(table);
+    table->destructor = destructor ? destructor : cht_destroy_entry;
+    atomic_init(&table->buckets, b);
+    atomic_init(&table->size, 0);
+    table->limbo = NULL;
+    table->retired = 0;
+
+    for (int i = 0; i < CHT_STRIPES; i++)
+        pthread_mutex_init(&table->locks[i], NULL);
+    pthread_mutex_init(&table->limbo_lock, NULL);
+
+    return table;
+}
+
+
+void chashtable_release(CHashTable *table) {
+
+    if (!table)
+        return;
+
+    struct cht_buckets *b = atomic_load(&table->buckets);
+
+    for (size_t i = 0; i < b->size; i++) {
+        struct cht_node *n = atomic_load(&b->heads[i]);
+        while (n) {
+            struct cht_node *next = atomic_load(&n->next);
+            table->destructor(&n->entry);
+            free(n);
+            n = next;
+        }
+    }
+
+    free(b);
+
+    while (table->limbo) {
+        struct cht_retired *next = table->limbo->next;
+        cht_free(table, table->limbo);
+        table->limbo = next;
+    }
+
+    for (int i = 0; i < CHT_STRIPES; i++)
+        pthread_mutex_destroy(&table->locks[i]);
+    pthread_mutex_destroy(&table->limbo_lock);
+
+    free(table);
+}
+
+
+size_t chashtable_size(CHashTable *table) {
+    return atomic_load(&table->size);
+}
+
+
+/*
+ * Writers of a bucket are serialized by the stripe lock, which also keeps
+ * the buckets from being replaced. Nodes are only published once complete.
+ */
+int chashtable_put(CHashTable *table, const char *key, void *val) {
+
+    assert(table && key);
+
+    uint64_t hash = hashtable_hash(key, table->seed);
+    struct cht_node *node = malloc(sizeof(*node));
+
+    if (!node)
+        return -HASHTABLE_OOM;
+
+    node->entry = (struct ht_entry) { key, val, hash };
+
+    pthread_mutex_lock(cht_lock(table, hash));
+
+    struct cht_buckets *b = atomic_load_explicit(&table->buckets,
+                                                 memory_order_relaxed);
+    _Atomic(struct cht_node *) *link = &b->heads[hash & (b->size - 1)];
+    struct cht_node *curr;
+
+    while ((curr = atomic_load_explicit(link, memory_order_relaxed))) {
+        if (curr->entry.hash == hash && strcmp(curr->entry.key, key) == 0)
+            break;
+        link = &curr->next;
+    }
+
+    /* An update swaps the node, values replaced aren't destroyed */
+    atomic_init(&node->next, curr ? atomic_load(&curr->next) : NULL);
+    atomic_store_explicit(link, node, memory_order_release);
+
+    size_t size = curr ? 0 : atomic_fetch_add(&table->size, 1) + 1;
+
+    /* Once unlocked, b may be replaced and released by a concurrent grow */
+    size_t buckets = b->size;
+
+    pthread_mutex_unlock(cht_lock(table, hash));
+
+    if (curr)
+        cht_retire(table, curr, CHT_NODE);
+    else if (size > buckets)
+        cht_grow(table);
+
+    return HASHTABLE_OK;
+}
+
+
+void *chashtable_get(CHashTable *table, const char *key) {
+
+    assert(table && key);
+
+    uint64_t hash = hashtable_hash(key, table->seed);
+    struct cht_thread *t = cht_enter();
+    void *val = NULL;
+
+    struct cht_buckets *b = atomic_load_explicit(&table->buckets,
+                                                 memory_order_acquire);
+    struct cht_node *n = atomic_load_explicit(&b->heads[hash & (b->size - 1)],
+                                              memory_order_acquire);
+
+    for (; n; n = atomic_load_explicit(&n->next, memory_order_acquire)) {
+        if (n->entry.hash == hash && strcmp(n->entry.key, key) == 0) {
+            val = n->entry.val;
+            break;
+        }
+    }
+
+    cht_exit(t);
+
+    return val;
+}
+
+
+int chashtable_del(CHashTable *table, const char *key) {
+
+    assert(table && key);
+
+    uint64_t hash = hashtable_hash(key, table->seed);
+
+    pthread_mutex_lock(cht_lock(table, hash));
+
+    struct cht_buckets *b = atomic_load_explicit(&table->buckets,
+                                                 memory_order_relaxed);
+    _Atomic(struct cht_node *) *link = &b->heads[hash & (b->size - 1)];
+    struct cht_node *curr;
+
+    while ((curr = atomic_load_explicit(link, memory_order_relaxed))) {
+        if (curr->entry.hash == hash && strcmp(curr->entry.key, key) == 0)
+            break;
+        link = &curr->next;
+    }
+
+    /* Readers on the node still find their way through its next */
+    if (curr) {
+        atomic_store_explicit(link, atomic_load(&curr->next),
+                              memory_order_release);
+        atomic_fetch_sub(&table->size, 1);
+    }
+
+    pthread_mutex_unlock(cht_lock(table, hash));
+
+    if (!curr)
+        return -HASHTABLE_ERR;
+
+    cht_retire(table, curr, CHT_ENTRY);
+
+    return HASHTABLE_OK;
+}
+
+
+int chashtable_map(CHashTable *table, ht_unary_fun *func) {
+
+    assert(func);
+
+    /* On empty hashmap, return immediately */
+    if (!table || chashtable_size(table) == 0)
+        return -HASHTABLE_ERR;
+
+    struct cht_thread *t = cht_enter();
+    struct cht_buckets *b = atomic_load_explicit(&table->buckets,
+                                                 memory_order_acquire);
+    int status = HASHTABLE_OK;
+
+    for (size_t i = 0; i < b->size && status == HASHTABLE_OK; i++) {
+        struct cht_node *n = atomic_load_explicit(&b->heads[i],
+                                                  memory_order_acquire);
+        for (; n && status == HASHTABLE_OK;
+             n = atomic_load_explicit(&n->next, memory_order_acquire)) {
+            struct ht_entry data = n->entry;
+            status = func(&data);
+        }
+    }
+
+    cht_exit(t);
+
+    return status;
+}
+
+
+int chashtable_map2(CHashTable *table, ht_binary_fun *func, void *param) {
+
+    assert(func);
+
+    /* On empty hashmap, return immediately */
+    if (!table || chashtable_size(table) == 0)
+        return -HASHTABLE_ERR;
+
+    struct cht_thread *t = cht_enter();
+    struct cht_buckets *b = atomic_load_explicit(&table->buckets,
+                                                 memory_order_acquire);
+    int status = HASHTABLE_OK;
+
+    for (size_t i = 0; i < b->size && status == HASHTABLE_OK; i++) {
+        struct cht_node *n = atomic_load_explicit(&b->heads[i],
+                                                  memory_order_acquire);
+        for (; n && status == HASHTABLE_OK;
+             n = atomic_load_explicit(&n->next, memory_order_acquire)) {
+            struct ht_entry data = n->entry;
+            status = func(&data, param);
+        }
+    }
+
+    cht_exit(t);
+
+    return status;
+}
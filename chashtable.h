@@ -0,0 +1,105 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CHASHTABLE_H
+#define CHASHTABLE_H
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include "hashtable.h"
+
+
+/* Write locks, a key always maps to the same stripe */
+#define CHT_STRIPES         64
+
+/*
+ * Threads concurrently using the tables, each one takes a slot on first use.
+ * Past that many, a new thread waits for one of them to exit.
+ */
+#define CHT_MAX_THREADS     128
+
+
+/*
+ * Chains are published with atomic stores, the entry of a node is immutable:
+ * an update replaces the whole node.
+ */
+struct cht_node {
+    struct ht_entry entry;
+    _Atomic(struct cht_node *) next;
+};
+
+
+struct cht_buckets {
+    size_t size;
+    _Atomic(struct cht_node *) heads[];
+};
+
+
+/*
+ * A concurrent HashTable, with the same API. Readers never lock, writers take
+ * the lock of the stripe of the key, a resize takes all of them. Unlinked
+ * nodes and old bucket arrays are released once no reader can still see
+ * them, tracking the epochs readers run in.
+ */
+typedef struct {
+    uint64_t seed;
+    ht_unary_fun *destructor;
+    _Atomic(struct cht_buckets *) buckets;
+    atomic_size_t size;
+    pthread_mutex_t locks[CHT_STRIPES];
+    pthread_mutex_t limbo_lock;
+    struct cht_retired *limbo;
+    size_t retired;
+} CHashTable;
+
+
+CHashTable *chashtable_create(ht_unary_fun *);
+
+/* Not thread safe, no other thread can be using the table */
+void chashtable_release(CHashTable *);
+
+size_t chashtable_size(CHashTable *);
+
+int chashtable_put(CHashTable *, const char *, void *);
+
+/* Never blocks, but for the first call of a thread waiting for a slot */
+void *chashtable_get(CHashTable *, const char *);
+
+/* The destructor is called once no reader can see the entry anymore */
+int chashtable_del(CHashTable *, const char *);
+
+/*
+ * Iterate over a snapshot of each bucket, entries put or deleted concurrently
+ * may be seen or not. The functor may call into the table.
+ */
+int chashtable_map(CHashTable *, ht_unary_fun *);
+
+int chashtable_map2(CHashTable *, ht_binary_fun *, void *);
+
+
+#endif
@@ -27,111 +27,1026 @@
  */
 
 #include "core.h"
+#include "vm.h"
+#include "bigint.h"
+
+
+/* Children arrays and strings of the expressions, nodes belong to the GC */
+static struct arena arena;
+
+/* Last version handed out to a context */
+static unsigned long context_versions;
+
+
+#define CONTEXT_INITIAL_SIZE    64
+
+/*
+ * Bindings moved to the new table by each put or delete during a resize, and
+ * slots visited at most for each of them
+ */
+#define CONTEXT_REHASH_STEP     4
+#define CONTEXT_REHASH_VISITS   8
+
+
+static inline size_t context_index(size_t capacity, unsigned id) {
+    return id & (capacity - 1);
+}
+
+
+/* Addresses of values taken before the call can't be trusted anymore */
+static inline void context_touch(Context *ctx) {
+    ctx->version = ++context_versions;
+}
+
+
+static struct binding *bindings_find(struct binding *bindings,
+                                     size_t capacity, unsigned id) {
+
+    size_t i = context_index(capacity, id);
+
+    while (bindings[i].val) {
+        if (bindings[i].id == id)
+            return &bindings[i];
+        i = context_index(capacity, i + 1);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Bindings not moved yet by a resize are still in the old table, moved ones
+ * are kept there so that probes go past them, but never found
+ */
+static struct binding *context_find(Context *ctx, unsigned id) {
+
+    struct binding *b = bindings_find(ctx->bindings, ctx->capacity, id);
+
+    if (!b && ctx->old) {
+        b = bindings_find(ctx->old, ctx->old_capacity, id);
+        if (b && b->moved)
+            b = NULL;
+    }
+
+    return b;
+}
+
+
+/* New bindings always go to the new table */
+static void context_insert(Context *ctx, unsigned id,
+                           struct expr *val, bool constant) {
+
+    size_t i = context_index(ctx->capacity, id);
+
+    while (ctx->bindings[i].val)
+        i = context_index(ctx->capacity, i + 1);
+
+    ctx->bindings[i].id = id;
+    ctx->bindings[i].constant = constant;
+    ctx->bindings[i].moved = false;
+    ctx->bindings[i].val = val;
+    ctx->size++;
+}
+
+
+/* Moves go through the old table in order, marking the slots left behind */
+int context_rehash_step(Context *ctx, size_t n) {
+
+    if (!ctx->old)
+        return 0;
+
+    context_touch(ctx);
+
+    size_t visits = n * CONTEXT_REHASH_VISITS;
+
+    while (n > 0 && visits-- > 0 && ctx->old_size > 0) {
+
+        struct binding *b = &ctx->old[ctx->rehash_idx++];
+
+        if (!b->val || b->moved)
+            continue;
+
+        context_insert(ctx, b->id, b->val, b->constant);
+        b->moved = true;
+        ctx->old_size--;
+        n--;
+    }
+
+    if (ctx->old_size > 0)
+        return 1;
+
+    free(ctx->old);
+    ctx->old = NULL;
+    ctx->old_capacity = 0;
+
+    return 0;
+}
+
+
+/*
+ * Keep the load under 50%, with sequential IDs probes are mostly 1 long. The
+ * bindings are moved a few at a time by the following puts and deletes, so
+ * that a single def never pays for the whole table.
+ */
+static void context_grow(Context *ctx) {
+
+    /* The previous resize didn't keep up, finish it first */
+    while (context_rehash_step(ctx, ctx->old_size))
+        ;
+
+    ctx->old = ctx->bindings;
+    ctx->old_capacity = ctx->capacity;
+    ctx->old_size = ctx->size;
+    ctx->rehash_idx = 0;
+
+    ctx->capacity *= 2;
+    ctx->bindings = calloc(ctx->capacity, sizeof(*ctx->bindings));
+    ctx->size = 0;
+}
 
 
 void context_init(Context *ctx) {
-    hashtable_init(ctx, NULL);
+    ctx->size = 0;
+    ctx->capacity = CONTEXT_INITIAL_SIZE;
+    ctx->bindings = calloc(ctx->capacity, sizeof(*ctx->bindings));
+    ctx->old = NULL;
+    ctx->old_size = ctx->old_capacity = 0;
+    ctx->frozen = (struct frozen) { .min_id = UINT_MAX };
+    context_touch(ctx);
+    gc_track_context(ctx);
 }
 
 
 void context_release(Context *ctx) {
-    hashtable_release(ctx);
+    gc_untrack_context(ctx);
+    free(ctx->bindings);
+    free(ctx->old);
+    ctx->bindings = ctx->old = NULL;
+    ctx->size = ctx->capacity = 0;
+    ctx->old_size = ctx->old_capacity = 0;
+    free(ctx->frozen.disp);
+    free(ctx->frozen.slots);
+    ctx->frozen = (struct frozen) { .min_id = UINT_MAX };
+    context_touch(ctx);
+}
+
+
+/*
+ * The frozen table is placed in the style of CHD: the ID picks a bucket, and
+ * each bucket gets a displacement, chosen at freeze time, that sends all of
+ * its IDs to free slots. There are as many slots as bindings, or a few more
+ * if they can't be placed, and a lookup compares a single slot.
+ */
+#define FROZEN_BUCKET_LOAD  4
+#define FROZEN_MAX_DISP     (1u << 16)
+
+
+/* Map a 32 bit hash to [0, n) with a multiply instead of a division */
+static inline size_t frozen_reduce(uint32_t hash, size_t n) {
+    return ((uint64_t) hash * n) >> 32;
+}
+
+
+/* Mix the ID, the halves pick the bucket and the slots of the bucket */
+static inline uint64_t frozen_hash(unsigned id) {
+    uint64_t h = id * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 32;
+    h *= 0xD6E8FEB86659FD93ULL;
+    return h ^ (h >> 32);
+}
+
+
+static inline size_t frozen_bucket(const struct frozen *f, uint64_t hash) {
+    return frozen_reduce((uint32_t) hash, f->buckets);
+}
+
+
+static inline size_t frozen_slot(const struct frozen *f,
+                                 uint64_t hash, unsigned disp) {
+    uint32_t h = (uint32_t) (hash >> 32) + disp * ((uint32_t) hash | 1);
+    return frozen_reduce(h, f->capacity);
+}
+
+
+static struct frozen_binding *frozen_find(const struct frozen *f,
+                                          unsigned id) {
+
+    if (id < f->min_id || id > f->max_id)
+        return NULL;
+
+    uint64_t hash = frozen_hash(id);
+    unsigned disp = f->disp[frozen_bucket(f, hash)];
+    struct frozen_binding *b = &f->slots[frozen_slot(f, hash, disp)];
+
+    return b->val && b->id == id ? b : NULL;
+}
+
+
+struct frozen_bucket {
+    size_t bucket;
+    size_t start;
+    size_t count;
+};
+
+
+/* Largest buckets first, they're the hardest to place */
+static int frozen_bucket_cmp(const void *a, const void *b) {
+    const struct frozen_bucket *x = a, *y = b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+
+/*
+ * Try displacements for the bucket until all of its IDs fall on free slots,
+ * distinct from each other. Slots are taken by setting their value.
+ */
+static bool frozen_place(struct frozen *f, const struct frozen_bucket *b,
+                         const struct frozen_binding *keys) {
+
+    for (unsigned d = 0; d < FROZEN_MAX_DISP; d++) {
+
+        size_t placed = 0;
+
+        for (; placed < b->count; placed++) {
+            const struct frozen_binding *k = &keys[b->start + placed];
+            uint64_t hash = frozen_hash(k->id);
+            struct frozen_binding *s = &f->slots[frozen_slot(f, hash, d)];
+            if (s->val)
+                break;
+            *s = *k;
+        }
+
+        if (placed == b->count) {
+            f->disp[b->bucket] = d;
+            return true;
+        }
+
+        /* Give the slots back */
+        while (placed-- > 0) {
+            uint64_t hash = frozen_hash(keys[b->start + placed].id);
+            f->slots[frozen_slot(f, hash, d)].val = NULL;
+        }
+    }
+
+    return false;
+}
+
+
+/* Place n bindings on capacity slots, false if they couldn't be placed */
+static bool frozen_build(struct frozen *f, const struct frozen_binding *all,
+                         size_t n, size_t capacity) {
+
+    f->size = n;
+    f->capacity = capacity;
+    f->buckets = n / FROZEN_BUCKET_LOAD + 1;
+    f->min_id = UINT_MAX;
+    f->max_id = 0;
+    f->disp = calloc(f->buckets, sizeof(*f->disp));
+    f->slots = calloc(capacity, sizeof(*f->slots));
+
+    struct frozen_bucket *buckets = calloc(f->buckets, sizeof(*buckets));
+    struct frozen_binding *keys = malloc(n * sizeof(*keys));
+    bool ok = f->disp && f->slots && buckets && keys;
+
+    /* Group the bindings by bucket, counting sort */
+    for (size_t i = 0; ok && i < n; i++)
+        buckets[frozen_bucket(f, frozen_hash(all[i].id))].count++;
+
+    for (size_t i = 0, start = 0; ok && i < f->buckets; i++) {
+        buckets[i].bucket = i;
+        buckets[i].start = start;
+        start += buckets[i].count;
+        buckets[i].count = 0;
+    }
+
+    for (size_t i = 0; ok && i < n; i++) {
+        size_t bucket = frozen_bucket(f, frozen_hash(all[i].id));
+        struct frozen_bucket *b = &buckets[bucket];
+        keys[b->start + b->count++] = all[i];
+        if (all[i].id < f->min_id)
+            f->min_id = all[i].id;
+        if (all[i].id > f->max_id)
+            f->max_id = all[i].id;
+    }
+
+    if (ok)
+        qsort(buckets, f->buckets, sizeof(*buckets), frozen_bucket_cmp);
+
+    for (size_t i = 0; ok && i < f->buckets && buckets[i].count > 0; i++)
+        ok = frozen_place(f, &buckets[i], keys);
+
+    free(buckets);
+    free(keys);
+
+    if (!ok) {
+        free(f->disp);
+        free(f->slots);
+    }
+
+    return ok;
+}
+
+
+int context_freeze(Context *ctx) {
+
+    /* All the bindings in a single table */
+    while (context_rehash_step(ctx, ctx->old_size))
+        ;
+
+    size_t n = ctx->frozen.size;
+    for (size_t i = 0; i < ctx->capacity; i++)
+        if (ctx->bindings[i].val && ctx->bindings[i].constant)
+            n++;
+
+    if (n == ctx->frozen.size)
+        return 0;
+
+    struct frozen_binding *all = malloc(n * sizeof(*all));
+    if (!all)
+        return -1;
+
+    size_t j = 0;
+    for (size_t i = 0; i < ctx->frozen.capacity; i++)
+        if (ctx->frozen.slots[i].val)
+            all[j++] = ctx->frozen.slots[i];
+
+    for (size_t i = 0; i < ctx->capacity; i++)
+        if (ctx->bindings[i].val && ctx->bindings[i].constant)
+            all[j++] = (struct frozen_binding) {
+                ctx->bindings[i].id, ctx->bindings[i].val
+            };
+
+    /* The last buckets are the hardest to place, give them some room */
+    struct frozen frozen;
+    bool ok = false;
+    for (size_t cap = n; !ok && cap <= 2 * n; cap += cap / 16 + 1)
+        ok = frozen_build(&frozen, all, n, cap);
+
+    free(all);
+
+    if (!ok)
+        return -1;
+
+    size_t left = ctx->size - (n - ctx->frozen.size);
+
+    free(ctx->frozen.disp);
+    free(ctx->frozen.slots);
+    ctx->frozen = frozen;
+    context_touch(ctx);
+
+    /* Only the bindings that can still change are left in the overlay */
+    struct binding *bindings = ctx->bindings;
+    size_t capacity = ctx->capacity;
+
+    ctx->size = 0;
+    ctx->capacity = CONTEXT_INITIAL_SIZE;
+    while (left > ctx->capacity / 2)
+        ctx->capacity *= 2;
+    ctx->bindings = calloc(ctx->capacity, sizeof(*ctx->bindings));
+
+    for (size_t i = 0; i < capacity; i++)
+        if (bindings[i].val && !bindings[i].constant)
+            context_insert(ctx, bindings[i].id, bindings[i].val, false);
+
+    free(bindings);
+
+    return 0;
+}
+
+
+static int context_bind(Context *ctx, struct expr *esym,
+                        struct expr *efun, bool constant) {
+
+    if (!esym || expr_type(esym) != SYMBOL)
+        return -1;
+
+    printf("adding symbol to context %s\n", intern_name(esym->symbol));
+
+    if (!efun)
+        return -1;
+
+    /* Frozen bindings are all constants */
+    if (frozen_find(&ctx->frozen, esym->symbol))
+        return -1;
+
+    context_rehash_step(ctx, CONTEXT_REHASH_STEP);
+
+    struct binding *b = context_find(ctx, esym->symbol);
+
+    if (b && b->constant)
+        return -1;
+
+    if (b) {
+        b->constant = constant;
+        b->val = efun;
+        return 0;
+    }
+
+    if (ctx->size + 1 > ctx->capacity / 2)
+        context_grow(ctx);
+
+    context_insert(ctx, esym->symbol, efun, constant);
+
+    return 0;
 }
 
 
 int context_put(Context *ctx, struct expr *esym, struct expr *efun) {
-    printf("adding symbol to context %s\n", esym->symbol);
-    return hashtable_put(ctx, esym->symbol, expr_copy(efun));
+    return context_bind(ctx, esym, efun, false);
+}
+
+
+int context_put_const(Context *ctx, struct expr *esym, struct expr *efun) {
+    return context_bind(ctx, esym, efun, true);
 }
 
 
 struct expr *context_get(Context *ctx, struct expr *exp) {
-    struct expr *e = hashtable_get(ctx, exp->symbol);
-    if (!e) {
-        struct expr *err = malloc(sizeof(*err));
-        expr_err(err, "Unbound symbol");
-        return err;
-    }
-    return expr_copy(e);
+    return context_lookup(ctx, exp->symbol);
+}
+
+
+struct expr *context_lookup(Context *ctx, unsigned id) {
+
+    struct frozen_binding *f = frozen_find(&ctx->frozen, id);
+    if (f)
+        return f->val;
+
+    struct binding *b = context_find(ctx, id);
+    if (!b)
+        return expr_new_err("Unbound symbol");
+    return b->val;
+}
+
+
+struct expr *context_get_const(Context *ctx, unsigned id) {
+
+    struct frozen_binding *f = frozen_find(&ctx->frozen, id);
+    if (f)
+        return f->val;
+
+    struct binding *b = context_find(ctx, id);
+    return b && b->constant ? b->val : NULL;
+}
+
+
+struct expr **context_slot(Context *ctx, unsigned id) {
+
+    struct frozen_binding *f = frozen_find(&ctx->frozen, id);
+    if (f)
+        return &f->val;
+
+    struct binding *b = context_find(ctx, id);
+    return b ? &b->val : NULL;
 }
 
 
+/* Backward shift deletion, no tombstones are left behind */
 int context_del(Context *ctx, struct expr *exp) {
-    return hashtable_del(ctx, exp->symbol);
+
+    if (!exp || expr_type(exp) != SYMBOL)
+        return -1;
+
+    if (frozen_find(&ctx->frozen, exp->symbol))
+        return -1;
+
+    context_rehash_step(ctx, CONTEXT_REHASH_STEP);
+
+    struct binding *b = context_find(ctx, exp->symbol);
+
+    if (!b || b->constant)
+        return -1;
+
+    context_touch(ctx);
+
+    /* Marked like a move, the old table is never shifted */
+    if (ctx->old && b >= ctx->old && b < ctx->old + ctx->old_capacity) {
+        b->moved = true;
+        ctx->old_size--;
+        return 0;
+    }
+
+    size_t i = b - ctx->bindings;
+    size_t j = i;
+
+    for (;;) {
+        j = context_index(ctx->capacity, j + 1);
+        if (!ctx->bindings[j].val)
+            break;
+        size_t k = context_index(ctx->capacity, ctx->bindings[j].id);
+        /* Move j back into the hole if its home slot isn't in (i, j] */
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+            ctx->bindings[i] = ctx->bindings[j];
+            i = j;
+        }
+    }
+
+    ctx->bindings[i].val = NULL;
+    ctx->size--;
+
+    return 0;
+}
+
+
+/* Views carry no inline storage, they never own their children */
+#define LIST_VIEW_SIZE      offsetof(struct list, items)
+
+
+static struct expr *expr_alloc_size(extype etype, size_t size) {
+    struct expr *exp = gc_alloc(size);
+    exp->etype = etype;
+    exp->count = 0;
+    return exp;
+}
+
+
+/* Atoms fit in the bare header, lists carry the state of their children */
+static struct expr *expr_alloc(extype etype) {
+    bool list = etype == SEXP || etype == QEXP || etype == LAMBDA
+        || etype == SEQ;
+    return expr_alloc_size(etype, list ? sizeof(struct list)
+                           : sizeof(struct expr));
+}
+
+
+/* True if the list owns an array in the arena */
+static inline bool expr_spilled(struct expr *exp) {
+    return !LIST(exp)->base && exp->children != LIST(exp)->items;
+}
+
+
+/* Called by the collector on unreachable nodes */
+void expr_release(struct expr *exp) {
+    switch (exp->etype) {
+        case SEXP:
+        case QEXP:
+            /* Views and inline lists don't own an array */
+            if (expr_spilled(exp))
+                arena_free(&arena, exp->children,
+                           LIST(exp)->capacity * sizeof(struct expr *));
+            break;
+        case STRING:
+            arena_free(&arena, exp->string, strlen(exp->string) + 1);
+            break;
+        case ERROR:
+            arena_free(&arena, exp->err, strlen(exp->err) + 1);
+            break;
+        case BIGINT:
+            arena_free(&arena, exp->limbs, BIGINT_SIZE(exp) * sizeof(uint32_t));
+            break;
+        case MAP:
+            hashtable_release(exp->map);
+            hashtable_u64_release(MAP_INTS(exp));
+            break;
+        case VECTOR:
+            if (exp->count > 0)
+                arena_free(&arena, VECTOR(exp)->ints,
+                           exp->count * sizeof(int64_t));
+            break;
+        case PROTO:
+            vm_proto_release(exp->proto);
+            break;
+        default:
+            break;
+    }
+}
+
+
+void expr_arena_stats(struct arena_stats *stats) {
+    arena_stats(&arena, stats);
+}
+
+
+static char *expr_strdup(const char *str) {
+    char *copy = arena_alloc(&arena, strlen(str) + 1);
+    strcpy(copy, str);
+    return copy;
 }
 
 
-void expr_string(struct expr *exp, char *str) {
-    exp->etype = STRING;
-    exp->string = str;
+struct expr *expr_new_string(char *str) {
+    struct expr *exp = expr_alloc(STRING);
+    exp->string = expr_strdup(str);
+    return exp;
 }
 
 
-void expr_integer(struct expr *exp, long long x) {
-    exp->etype = INTEGER;
+struct expr *expr_new_integer(long long x) {
+
+    if (x >= FIXNUM_MIN && x <= FIXNUM_MAX)
+        return FIXNUM(x);
+
+    struct expr *exp = expr_alloc(INTEGER);
     exp->integer = x;
+    return exp;
 }
 
 
-void expr_decimal(struct expr *exp, double x) {
-    exp->etype = DECIMAL;
+struct expr *expr_new_decimal(double x) {
+    struct expr *exp = expr_alloc(DECIMAL);
     exp->decimal = x;
+    return exp;
 }
 
 
-void expr_operator(struct expr *exp, char op) {
-    exp->etype = SYMBOL;
-    exp->symbol[0] = op;
-    exp->symbol[1] = '\0';
+struct expr *expr_new_bigint(const struct bigint *b) {
+
+    long long x;
+
+    if (bigint_get_ll(b, &x))
+        return expr_new_integer(x);
+
+    struct expr *exp = expr_alloc(BIGINT);
+    exp->limbs = arena_alloc(&arena, b->size * sizeof(uint32_t));
+    memcpy(exp->limbs, b->limbs, b->size * sizeof(uint32_t));
+    exp->count = b->negative ? -b->size : b->size;
+    return exp;
 }
 
 
-void expr_symbol(struct expr *exp, char *sym) {
-    exp->etype = SYMBOL;
-    strcpy(exp->symbol, sym);
+void expr_get_bigint(const struct expr *exp, struct bigint *b) {
+    if (expr_type(exp) == BIGINT)
+        bigint_set_limbs(b, exp->limbs, BIGINT_SIZE(exp), exp->count < 0);
+    else
+        bigint_set_ll(b, expr_ival(exp));
 }
 
 
-void expr_sexp(struct expr *exp) {
-    exp->etype = SEXP;
-    exp->count = 0;
-    exp->capacity = 4;
-    exp->children = malloc(exp->capacity * sizeof(struct expr *));
+struct expr *expr_new_operator(char op) {
+    char sym[2] = { op, '\0' };
+    return expr_new_symbol(sym);
 }
 
 
-void expr_qexp(struct expr *exp) {
-    exp->etype = QEXP;
-    exp->count = 0;
-    exp->capacity = 4;
-    exp->children = malloc(exp->capacity * sizeof(struct expr *));
+struct expr *expr_new_symbol(char *sym) {
+    struct expr *exp = expr_alloc(SYMBOL);
+    exp->symbol = intern(sym);
+    return exp;
+}
+
+
+static struct expr *expr_new_list(extype etype) {
+    struct expr *exp = expr_alloc(etype);
+    LIST(exp)->capacity = LIST_INLINE;
+    LIST(exp)->base = NULL;
+    exp->children = LIST(exp)->items;
+    return exp;
 }
 
 
-void expr_end(struct expr *exp) {
-    exp->etype = SEXP_END;
+struct expr *expr_new_sexp(void) {
+    return expr_new_list(SEXP);
 }
 
 
-void expr_err(struct expr *exp, char *err) {
-    exp->etype = ERROR;
-    strncpy(exp->err, err, MAX_ERR_SIZE);
-    exp->err[MAX_ERR_SIZE - 1] = '\0';
+struct expr *expr_new_qexp(void) {
+    return expr_new_list(QEXP);
 }
 
 
-void expr_fun(struct expr *exp, fun *fn) {
-    exp->etype = FUNCTION;
+struct expr *expr_new_end(void) {
+    return expr_alloc(SEXP_END);
+}
+
+
+/* Errors are rare, the message is only allocated on the error path */
+struct expr *expr_new_err(char *err) {
+    struct expr *exp = expr_alloc(ERROR);
+    exp->err = expr_strdup(err);
+    return exp;
+}
+
+
+struct expr *expr_new_fun(fun *fn) {
+    struct expr *exp = expr_alloc(FUNCTION);
     exp->fn = fn;
+    return exp;
 }
 
 
-struct expr *expr_append(struct expr *exp, struct expr *nexp) {
-    if (exp->count + 1 >= exp->capacity / 2) {
-        exp->capacity *= 2;
-        exp->children = realloc(exp->children,
-                                  exp->capacity * sizeof(struct expr *));
+struct expr *expr_new_lambda(struct expr *proto, struct expr *env) {
+    struct expr *exp = expr_new_list(LAMBDA);
+    exp->children[0] = proto;
+    exp->children[1] = env;
+    exp->count = 2;
+    return exp;
+}
+
+
+struct expr *expr_new_seq(seqkind kind, struct expr *arg, struct expr *src) {
+    struct expr *exp = expr_new_list(SEQ);
+    exp->children[0] = expr_new_integer(kind);
+    exp->children[1] = arg;
+    exp->children[2] = src;
+    exp->count = 3;
+    return exp;
+}
+
+
+/* Bounds and step are integers, only boxed if they don't fit a fixnum */
+struct expr *expr_new_range(long long start, long long end, long long step) {
+    struct expr *exp = expr_new_list(SEQ);
+    exp->children[0] = expr_new_integer(SEQ_RANGE);
+    exp->children[1] = expr_new_integer(start);
+    exp->children[2] = expr_new_integer(end);
+    exp->children[3] = expr_new_integer(step);
+    exp->count = 4;
+    return exp;
+}
+
+
+struct expr *expr_new_proto(struct proto *proto) {
+    struct expr *exp = expr_alloc(PROTO);
+    exp->proto = proto;
+    return exp;
+}
+
+
+/* Keys are owned by the map, values by the collector */
+static int expr_map_entry_del(struct ht_entry *entry) {
+    free((void *) entry->key);
+    return HASHTABLE_OK;
+}
+
+
+/* Integer keys are stored by value, there's nothing to free */
+static int expr_map_int_del(struct ht_u64_entry *entry) {
+    (void) entry;
+    return HASHTABLE_OK;
+}
+
+
+struct expr *expr_new_map(void) {
+
+    HashTable *map = hashtable_create(expr_map_entry_del);
+    if (!map)
+        return expr_new_err("Out of memory");
+
+    struct expr *exp = expr_alloc_size(MAP, sizeof(struct map));
+    exp->map = map;
+    MAP_INTS(exp) = NULL;
+    return exp;
+}
+
+
+/* The table of the integer keys, created along with the first of them */
+static HashTableU64 *expr_map_ints(struct expr *exp) {
+    if (!MAP_INTS(exp))
+        MAP_INTS(exp) = hashtable_u64_create(expr_map_int_del);
+    return MAP_INTS(exp);
+}
+
+
+static int expr_map_copy_entry(struct ht_entry *entry, void *map) {
+
+    char *key = malloc(strlen(entry->key) + 1);
+    if (!key)
+        return -HASHTABLE_OOM;
+
+    strcpy(key, entry->key);
+
+    return hashtable_put(map, key, entry->val);
+}
+
+
+static int expr_map_copy_int(struct ht_u64_entry *entry, void *ints) {
+    return hashtable_u64_put(ints, entry->key, entry->val);
+}
+
+
+struct expr *expr_map_copy(struct expr *exp) {
+
+    struct expr *copy = expr_new_map();
+
+    if (expr_type(copy) != MAP)
+        return copy;
+
+    if (hashtable_size(exp->map) > 0
+        && hashtable_map2(exp->map, expr_map_copy_entry, copy->map) != 0)
+        return expr_new_err("Out of memory");
+
+    if (MAP_INTS(exp) && hashtable_u64_size(MAP_INTS(exp)) > 0
+        && (!expr_map_ints(copy)
+            || hashtable_u64_map2(MAP_INTS(exp), expr_map_copy_int,
+                                  MAP_INTS(copy)) != 0))
+        return expr_new_err("Out of memory");
+
+    return copy;
+}
+
+
+/*
+ * Symbols, strings and bigints are encoded to a string, the first char tells
+ * the type. NULL is returned for anything else, the key is to be freed.
+ */
+static char *expr_map_key(struct expr *exp) {
+
+    const char *name;
+    char *digits = NULL;
+    char tag;
+
+    switch (expr_type(exp)) {
+        case SYMBOL:
+            tag = 'y';
+            name = intern_name(exp->symbol);
+            break;
+        case STRING:
+            tag = 's';
+            name = exp->string;
+            break;
+        case BIGINT: {
+            struct bigint b;
+            bigint_init(&b);
+            expr_get_bigint(exp, &b);
+            tag = 'i';
+            name = digits = bigint_to_string(&b);
+            bigint_free(&b);
+            break;
+        }
+        default:
+            return NULL;
+    }
+
+    char *key = malloc(strlen(name) + 2);
+
+    if (key) {
+        key[0] = tag;
+        strcpy(key + 1, name);
     }
+
+    free(digits);
+
+    return key;
+}
+
+
+/* The expression an encoded key comes from */
+static struct expr *expr_map_key_expr(const char *key) {
+    switch (key[0]) {
+        case 'i': {
+            struct bigint b;
+            bigint_init(&b);
+            bigint_from_string(&b, key + 1);
+            struct expr *exp = expr_new_bigint(&b);
+            bigint_free(&b);
+            return exp;
+        }
+        case 's':
+            return expr_new_string((char *) key + 1);
+        default:
+            return expr_new_symbol((char *) key + 1);
+    }
+}
+
+
+/* The old key is freed on update, the new one is owned by the map */
+int expr_map_put(struct expr *exp, struct expr *key, struct expr *val) {
+
+    if (expr_type(key) == INTEGER) {
+        HashTableU64 *ints = expr_map_ints(exp);
+        if (!ints || hashtable_u64_put(ints, (uint64_t) expr_ival(key),
+                                       val) != HASHTABLE_OK)
+            return -HASHTABLE_OOM;
+        return HASHTABLE_OK;
+    }
+
+    char *k = expr_map_key(key);
+    if (!k)
+        return -HASHTABLE_ERR;
+
+    hashtable_del(exp->map, k);
+
+    if (hashtable_put(exp->map, k, val) != HASHTABLE_OK) {
+        free(k);
+        return -HASHTABLE_OOM;
+    }
+
+    return HASHTABLE_OK;
+}
+
+
+int expr_map_get(struct expr *exp, struct expr *key, struct expr **val) {
+
+    if (expr_type(key) == INTEGER) {
+        *val = MAP_INTS(exp) ?
+            hashtable_u64_get(MAP_INTS(exp), (uint64_t) expr_ival(key)) : NULL;
+        return HASHTABLE_OK;
+    }
+
+    char *k = expr_map_key(key);
+    if (!k)
+        return -HASHTABLE_ERR;
+
+    *val = hashtable_get(exp->map, k);
+    free(k);
+
+    return HASHTABLE_OK;
+}
+
+
+int expr_map_del(struct expr *exp, struct expr *key) {
+
+    if (expr_type(key) == INTEGER) {
+        if (MAP_INTS(exp))
+            hashtable_u64_del(MAP_INTS(exp), (uint64_t) expr_ival(key));
+        return HASHTABLE_OK;
+    }
+
+    char *k = expr_map_key(key);
+    if (!k)
+        return -HASHTABLE_ERR;
+
+    hashtable_del(exp->map, k);
+    free(k);
+
+    return HASHTABLE_OK;
+}
+
+
+size_t expr_map_size(struct expr *exp) {
+    return hashtable_size(exp->map)
+        + (MAP_INTS(exp) ? hashtable_u64_size(MAP_INTS(exp)) : 0);
+}
+
+
+struct map_iter {
+    int (*fn)(struct expr *, struct expr *, void *);
+    void *arg;
+};
+
+
+static int expr_map_each_entry(struct ht_entry *entry, void *iter) {
+    struct map_iter *it = iter;
+    return it->fn(expr_map_key_expr(entry->key), entry->val, it->arg);
+}
+
+
+static int expr_map_each_int(struct ht_u64_entry *entry, void *iter) {
+    struct map_iter *it = iter;
+    return it->fn(expr_new_integer((long long) entry->key),
+                  entry->val, it->arg);
+}
+
+
+int expr_map_each(struct expr *exp,
+                  int (*fn)(struct expr *, struct expr *, void *), void *arg) {
+
+    struct map_iter it = { fn, arg };
+    int status = HASHTABLE_OK;
+
+    /* Empty tables are an error to map over */
+    if (hashtable_size(exp->map) > 0)
+        status = hashtable_map2(exp->map, expr_map_each_entry, &it);
+
+    if (status == HASHTABLE_OK && MAP_INTS(exp)
+        && hashtable_u64_size(MAP_INTS(exp)) > 0)
+        status = hashtable_u64_map2(MAP_INTS(exp), expr_map_each_int, &it);
+
+    return status;
+}
+
+
+struct expr *expr_new_vector(int n, bool decimal) {
+
+    struct expr *exp = expr_alloc_size(VECTOR, sizeof(struct vector));
+
+    /* Integers and decimals take the same room */
+    exp->count = n;
+    VECTOR(exp)->decimal = decimal;
+    VECTOR(exp)->ints = n > 0 ? arena_alloc(&arena, n * sizeof(int64_t))
+        : NULL;
+
+    return exp;
+}
+
+
+/*
+ * Move the children to an array of the given capacity in the arena, it's how
+ * a view gets its own copy before being modified and how lists grow past the
+ * inline storage.
+ */
+static void expr_spill(struct expr *exp, int capacity) {
+
+    struct list *l = LIST(exp);
+    struct expr **children = arena_alloc(&arena,
+                                         capacity * sizeof(struct expr *));
+
+    memcpy(children, exp->children, exp->count * sizeof(struct expr *));
+
+    if (expr_spilled(exp))
+        arena_free(&arena, exp->children, l->capacity * sizeof(struct expr *));
+
+    exp->children = children;
+    l->capacity = capacity;
+    l->base = NULL;
+}
+
+
+struct expr *expr_append(struct expr *exp, struct expr *nexp) {
+    struct list *l = LIST(exp);
+    if (l->base || exp->count == l->capacity)
+        expr_spill(exp, exp->count < LIST_INLINE ?
+                   2 * LIST_INLINE : 2 * exp->count);
     exp->children[exp->count++] = nexp;
     return exp;
 }
@@ -146,6 +1061,18 @@ struct expr *expr_pop(struct expr *v, int i) {
     /* Find the item at "i" */
     struct expr *x = v->children[i];
 
+    struct list *l = LIST(v);
+
+    /* Popping the head of a view just narrows it */
+    if (l->base && i == 0) {
+        v->children++;
+        v->count--;
+        return x;
+    }
+
+    if (l->base)
+        expr_spill(v, v->count);
+
     /* Shift memory after the item at "i" over the top */
     memmove(&v->children[i], &v->children[i+1],
             sizeof(struct expr *) * (v->count-i-1));
@@ -154,89 +1081,37 @@ struct expr *expr_pop(struct expr *v, int i) {
     v->count--;
 
     /* Reallocate the memory used */
-    if (v->count < v->capacity / 3) {
-        v->capacity /= 2;
-        v->children = realloc(v->children, sizeof(struct expr *) * v->capacity);
-    }
+    if (expr_spilled(v) && v->count < l->capacity / 3)
+        expr_spill(v, l->capacity / 2);
 
     return x;
 }
 
 
-void expr_del(struct expr *v) {
-
-    if (!v)
-        return;
+struct expr *expr_slice(struct expr *exp, int start, int end) {
 
-    switch (v->etype) {
+    struct expr *x = expr_alloc_size(exp->etype, LIST_VIEW_SIZE);
 
-        /* If exprr then delete all elements inside */
-        case QEXP:
-        case SEXP:
-            for (int i = 0; i < v->count; i++)
-                expr_del(v->children[i]);
+    x->children = exp->children + start;
+    x->count = end - start;
+    LIST(x)->capacity = 0;
 
-            /* Also free the memory allocated to contain the pointers */
-            free(v->children);
+    /* Always point to the owner, views of views don't chain */
+    LIST(x)->base = LIST(exp)->base ? LIST(exp)->base : exp;
 
-            break;
-        case STRING:
-            free(v->string);
-            break;
-        default:
-            break;
-    }
-
-    /* Free the memory allocated for the "expr" struct itself */
-    free(v);
-}
-
-
-struct expr *expr_take(struct expr *v, int i) {
-    struct expr *x = expr_pop(v, i);
-    expr_del(v);
     return x;
 }
 
 
-struct expr *expr_copy(struct expr *exp) {
+struct expr *expr_unquote(struct expr *exp) {
 
-    if (!exp)
-        return NULL;
+    int n = expr_arg_count(exp);
 
-    struct expr *x = malloc(sizeof(*x));
-    x->etype = exp->etype;
+    if (n == 1)
+        return exp->children[0];
 
-    switch (exp->etype) {
-        case FUNCTION:
-            x->fn = exp->fn;
-            break;
-        case INTEGER:
-            x->integer = exp->integer;
-            break;
-        case DECIMAL:
-            x->decimal = exp->decimal;
-            break;
-        case SYMBOL:
-            strcpy(x->symbol, exp->symbol);
-            break;
-        case SEXP:
-        case QEXP:
-            x->count = exp->count;
-            x->children = malloc(x->count * sizeof(struct expr *));
-            for (int i = 0; i < x->count; i++)
-                x->children[i] = expr_copy(exp->children[i]);
-            break;
-        case ERROR:
-            strcpy(x->err, exp->err);
-            break;
-        case STRING:
-            x->string = malloc(strlen(exp->string) + 1);
-            strcpy(x->string, exp->string);
-            break;
-        default:
-            break;
-    }
+    struct expr *x = expr_slice(exp, 0, n);
+    x->etype = SEXP;
 
     return x;
 }
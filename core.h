@@ -31,6 +31,11 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include "gc.h"
+#include "arena.h"
+#include "intern.h"
 #include "hashtable.h"
 
 
@@ -41,6 +46,7 @@
 #define ERR_DIV_BY_ZERO     "Division by zero"
 #define ERR_INVALID_INT_OP  "Invalid operation between integers"
 #define ERR_INVALID_DEC_OP  "Invalid operation between decimals"
+#define ERR_INT_OVERFLOW    "Integer overflow"
 
 
 typedef enum {
@@ -49,75 +55,347 @@ typedef enum {
     QEXP,
     FUNCTION,
     INTEGER,
+    BIGINT,
     DECIMAL,
     SYMBOL,
     STRING,
-    ERROR
+    ERROR,
+    MAP,
+    VECTOR,
+    LAMBDA,
+    SEQ,
+    PROTO
 } extype;
 
 
-typedef HashTable Context;
+/*
+ * Integers fitting in 63 bits are never allocated, they're stored directly
+ * inside the struct expr pointer with the lowest bit set. Nodes are always
+ * at least 16 bytes aligned, so the bit is never set on a real pointer.
+ */
+#define FIXNUM_MIN          (LLONG_MIN >> 1)
+#define FIXNUM_MAX          (LLONG_MAX >> 1)
+#define IS_FIXNUM(e)        (((uintptr_t) (e)) & 1)
+#define FIXNUM(n)           ((struct expr *) ((((uintptr_t) (n)) << 1) | 1))
+#define FIXNUM_VAL(e)       ((long long) (((intptr_t) (e)) >> 1))
+
 
-// struct context {
-//     int count;
-//     int capacity;
-//     struct function {
-//         char *symbol;
-//         struct expr *exp;
-//     } **funcs;
-// };
+/*
+ * A context binds interned symbol IDs to values. IDs are dense, so the ID
+ * itself is used as hash, with linear probing on a power of two table.
+ * Constant bindings, like the builtins, can't be redefined or deleted.
+ *
+ * Resizes are incremental, until all the bindings are moved the old table
+ * stays live and is looked up after the new one.
+ *
+ * Once frozen, the constant bindings move to a read-only table placed by a
+ * minimal perfect hash, looked up first with a single probe. The table above
+ * is left as an overlay for the bindings defined later.
+ *
+ * The version changes whenever a binding may have moved or gone away, so that
+ * the address of a value can be kept as long as the version stays the same.
+ * Versions are unique across contexts.
+ */
+typedef struct context {
+    unsigned long version;
+    size_t size;
+    size_t capacity;
+    struct binding {
+        unsigned id;
+        bool constant;
+        bool moved;
+        struct expr *val;
+    } *bindings;
+    struct binding *old;
+    size_t old_size;
+    size_t old_capacity;
+    size_t rehash_idx;      /* Next slot of the old table to move */
+    struct frozen {
+        size_t size;
+        size_t capacity;
+        size_t buckets;
+        unsigned min_id;    /* IDs out of range are rejected before hashing */
+        unsigned max_id;
+        unsigned *disp;     /* Displacement of each bucket */
+        struct frozen_binding {
+            unsigned id;
+            struct expr *val;
+        } *slots;
+    } frozen;
+} Context;
 
 
 typedef struct expr *fun(Context *, struct expr *);
 
 
+/* Compiled body of a lambda, see vm.h */
+struct proto;
+
+/* Arbitrary precision integer, see bigint.h */
+struct bigint;
+
+
+/*
+ * Expressions are owned by the garbage collector and freely shared, once
+ * built they must be considered immutable, builtins always return new
+ * expressions instead of modifying their arguments.
+ *
+ * The common header is kept to 16 bytes: a packed tag, the count of children
+ * for lists and a single word of payload. Anything bigger, like strings and
+ * error messages, is allocated out of line.
+ */
 struct expr {
-    extype etype;
+    unsigned char etype;
+    unsigned char gc;
+    int count;
     union {
-        struct {
-            struct expr **children;
-            int count;
-            int capacity;
-        };
+        struct expr **children;
         char *string;
-        char symbol[MAX_SYM_SIZE];
-        char err[MAX_ERR_SIZE];
+        char *err;
+        unsigned symbol;
         long long integer;
+        uint32_t *limbs;
         double decimal;
         fun *fn;
+        HashTable *map;
+        struct proto *proto;
+        struct expr *next;
     };
 };
 
 
+/*
+ * Lists extend the header with the state of their children array, they
+ * either own it or, when base is set, are a view over a slice of the array
+ * owned by base, see expr_slice.
+ *
+ * Up to LIST_INLINE children are stored in the node itself, so that small
+ * forms fit in a single cache line, longer lists spill to the arena.
+ */
+#define LIST_INLINE         4
+
+struct list {
+    struct expr exp;
+    int capacity;
+    struct expr *base;
+    struct expr *items[LIST_INLINE];
+};
+
+
+#define LIST(e)             ((struct list *) (e))
+
+
+/*
+ * Vectors are unboxed arrays of count numbers, either all integers or all
+ * decimals, laid out contiguously in the arena for the kernels of simd.h
+ */
+struct vector {
+    struct expr exp;
+    bool decimal;
+    union {
+        int64_t *ints;
+        double *reals;
+    };
+};
+
+
+#define VECTOR(e)           ((struct vector *) (e))
+
+
+/*
+ * Maps extend the header with a second table, keyed by value, for their
+ * integer keys. It's only created along with the first of them.
+ */
+struct map {
+    struct expr exp;
+    HashTableU64 *ints;
+};
+
+
+#define MAP_INTS(e)         (((struct map *) (e))->ints)
+
+
+/*
+ * Integers not fitting a long long are BIGINT, their limbs are in the arena
+ * and the count of them is stored in count, negated for negative numbers
+ */
+#define BIGINT_SIZE(e)      ((e)->count < 0 ? -(e)->count : (e)->count)
+
+
+/*
+ * Lambdas are closures, laid out as lists of two: the PROTO of their body and
+ * the frame they were created in, NULL at top level
+ */
+#define LAMBDA_PROTO(e)     ((e)->children[0]->proto)
+#define LAMBDA_ENV(e)       ((e)->children[1])
+
+
+/*
+ * Lazy sequences are laid out as lists as well: the kind of the stage, its
+ * argument and the sequence it pulls from, either another SEQ or a list.
+ * Ranges are the sources, they hold their start, end and step instead.
+ */
+typedef enum { SEQ_RANGE, SEQ_MAP, SEQ_FILTER, SEQ_TAKE } seqkind;
+
+#define SEQ_KIND(e)         ((seqkind) FIXNUM_VAL((e)->children[0]))
+#define SEQ_ARG(e)          ((e)->children[1])
+#define SEQ_SOURCE(e)       ((e)->children[2])
+
+
+/* Type of an expression, immediate integers included */
+static inline extype expr_type(const struct expr *exp) {
+    return IS_FIXNUM(exp) ? INTEGER : (extype) exp->etype;
+}
+
+/* Value of an INTEGER expression, either immediate or boxed */
+static inline long long expr_ival(const struct expr *exp) {
+    return IS_FIXNUM(exp) ? FIXNUM_VAL(exp) : exp->integer;
+}
+
+/* Count of the arguments, top level forms keep the end markers of the parser */
+static inline int expr_arg_count(const struct expr *exp) {
+    int n = exp->count;
+    while (n > 0 && exp->children[n - 1]
+           && expr_type(exp->children[n - 1]) == SEXP_END)
+        n--;
+    return n;
+}
+
+/* Zeros and empty lists are false, anything else is true */
+static inline bool expr_truthy(const struct expr *exp) {
+    switch (expr_type(exp)) {
+        case INTEGER:
+            return expr_ival(exp) != 0;
+        case DECIMAL:
+            return exp->decimal != 0.0;
+        case SEXP:
+        case QEXP:
+            return expr_arg_count(exp) > 0;
+        default:
+            return true;
+    }
+}
+
+
 void context_init(Context *);
 
 void context_release(Context *);
 
+/*
+ * Return -1 if the key isn't a symbol, the value is NULL or the symbol is
+ * bound to a constant
+ */
 int context_put(Context *, struct expr *, struct expr *);
 
+int context_put_const(Context *, struct expr *, struct expr *);
+
 struct expr *context_get(Context *, struct expr *);
 
+/* Same as context_get, by symbol ID */
+struct expr *context_lookup(Context *, unsigned);
+
+/* Value of a constant binding, NULL if the symbol isn't bound to a constant */
+struct expr *context_get_const(Context *, unsigned);
+
+/*
+ * Address of the value bound to a symbol ID, NULL if unbound. It stays valid,
+ * following redefinitions, until the version of the context changes.
+ */
+struct expr **context_slot(Context *, unsigned);
+
 int context_del(Context *, struct expr *);
 
-void expr_string(struct expr *, char *);
+/*
+ * Move at least n bindings of an ongoing resize to the new table, ahead of
+ * the puts that would do it. Return 1 if the resize is still in progress.
+ */
+int context_rehash_step(Context *, size_t);
+
+/*
+ * Move the constant bindings to the frozen table, merging them with the ones
+ * already frozen. Return 0 on success, -1 if no perfect hash was found, the
+ * context is left as it was.
+ */
+int context_freeze(Context *);
+
+/*
+ * Nodes are allocated by the garbage collector, children arrays, strings and
+ * error messages live in an arena and are released with the owning node.
+ */
+void expr_release(struct expr *);
+
+void expr_arena_stats(struct arena_stats *);
 
-void expr_integer(struct expr *, long long);
+struct expr *expr_new_string(char *);
+
+/*
+ * Return an INTEGER expression, only values outside of the fixnum range
+ * require a node to be allocated
+ */
+struct expr *expr_new_integer(long long);
 
-void expr_decimal(struct expr *, double);
+struct expr *expr_new_decimal(double);
 
-void expr_operator(struct expr *, char);
+/* An INTEGER if the value fits a long long, a BIGINT otherwise */
+struct expr *expr_new_bigint(const struct bigint *);
 
-void expr_symbol(struct expr *, char *);
+/* Value of an INTEGER or BIGINT expression, in an initialized bigint */
+void expr_get_bigint(const struct expr *, struct bigint *);
 
-void expr_sexp(struct expr *);
+struct expr *expr_new_operator(char);
 
-void expr_qexp(struct expr *);
+struct expr *expr_new_symbol(char *);
 
-void expr_end(struct expr *);
+struct expr *expr_new_sexp(void);
 
-void expr_err(struct expr *, char *);
+struct expr *expr_new_qexp(void);
 
-void expr_fun(struct expr *, fun *);
+struct expr *expr_new_end(void);
+
+struct expr *expr_new_err(char *);
+
+struct expr *expr_new_fun(fun *);
+
+/* A closure over a frame, the PROTO is shared by all the closures of a body */
+struct expr *expr_new_lambda(struct expr *, struct expr *);
+
+struct expr *expr_new_seq(seqkind, struct expr *, struct expr *);
+
+struct expr *expr_new_range(long long, long long, long long);
+
+/* Take ownership of a compiled body, released with the node */
+struct expr *expr_new_proto(struct proto *);
+
+/*
+ * Maps are hashtables from symbols, strings and integers to expressions.
+ * Integers are keys by value, the other keys are encoded to strings tagged
+ * with their type. Like any other expression a map isn't modified once built,
+ * see expr_map_copy.
+ */
+struct expr *expr_new_map(void);
+
+/* Copy of a map, keys included, values are shared */
+struct expr *expr_map_copy(struct expr *);
+
+/*
+ * Access by key, -HASHTABLE_ERR is returned if the key can't be one and
+ * -HASHTABLE_OOM if the map can't grow. A missing key is no error, get sets
+ * the value to NULL.
+ */
+int expr_map_put(struct expr *, struct expr *, struct expr *);
+
+int expr_map_get(struct expr *, struct expr *, struct expr **);
+
+int expr_map_del(struct expr *, struct expr *);
+
+size_t expr_map_size(struct expr *);
+
+/* Apply a function to every key and value, the keys are new expressions */
+int expr_map_each(struct expr *,
+                  int (*)(struct expr *, struct expr *, void *), void *);
+
+/* A vector of n elements, left uninitialized */
+struct expr *expr_new_vector(int, bool);
 
 struct expr *expr_append(struct expr *, struct expr *);
 
@@ -125,10 +403,16 @@ struct expr *expr_peek(struct expr *, int);
 
 struct expr *expr_pop(struct expr *, int);
 
-void expr_del(struct expr *);
-
-struct expr *expr_take(struct expr *, int);
+/*
+ * Return a new list of the same type with the children in [start, end), in
+ * O(1), the new list shares the children array with the original one.
+ */
+struct expr *expr_slice(struct expr *, int, int);
 
-struct expr *expr_copy(struct expr *);
+/*
+ * Form quoted by a Q-expression, like the body of a lambda: its only element
+ * or an S-expression view of all of them
+ */
+struct expr *expr_unquote(struct expr *);
 
 #endif
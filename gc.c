@@ -0,0 +1,359 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include "core.h"
+#include "vm.h"
+
+
+/*
+ * Nodes are carved out of fixed size pages with a bump pointer, every page
+ * serves a single size class. Slots freed by a sweep are chained in the free
+ * list of their class and recycled first.
+ */
+struct gc_page {
+    struct gc_page *next;
+    size_t size;
+    size_t top;
+    _Alignas(GC_ALIGN) unsigned char data[];
+};
+
+
+#define GC_PAGE_SLOTS(p) \
+    ((GC_PAGE_SIZE - sizeof(struct gc_page)) / (p)->size)
+#define GC_SLOT(p, i)       ((struct expr *) ((p)->data + (i) * (p)->size))
+
+
+struct gc_class {
+    struct gc_page *pages;
+    struct expr *free_list;
+};
+
+
+static struct {
+    struct gc_class classes[GC_CLASSES];
+    Context *contexts[GC_MAX_CONTEXTS];
+    struct {
+        struct expr **slots;
+        size_t *size;
+    } stacks[GC_MAX_STACKS];
+    struct expr **roots;
+    size_t roots_size;
+    size_t roots_capacity;
+    struct expr **gray;
+    size_t gray_size;
+    size_t gray_capacity;
+    struct gc_stats stats;
+} gc = { .stats = { .threshold = GC_MIN_THRESHOLD } };
+
+
+static inline double now_ms(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+
+static void gc_grow(struct gc_class *class, size_t size) {
+
+    struct gc_page *page = malloc(GC_PAGE_SIZE);
+
+    if (!page) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    page->size = size;
+    page->top = 0;
+    page->next = class->pages;
+    class->pages = page;
+    gc.stats.pages++;
+    gc.stats.heap_size += GC_PAGE_SIZE;
+}
+
+
+struct expr *gc_alloc(size_t size) {
+
+    assert(size > 0 && size <= GC_MAX_SIZE);
+
+    size_t idx = (size - 1) / GC_ALIGN;
+    struct gc_class *class = &gc.classes[idx];
+    struct expr *exp = class->free_list;
+
+    if (exp) {
+        class->free_list = exp->next;
+    } else {
+        struct gc_page *page = class->pages;
+        if (!page || page->top == GC_PAGE_SLOTS(page)) {
+            gc_grow(class, (idx + 1) * GC_ALIGN);
+            page = class->pages;
+        }
+        exp = GC_SLOT(page, page->top++);
+    }
+
+    exp->gc = GC_USED;
+    gc.stats.allocated++;
+
+    return exp;
+}
+
+
+void gc_track_context(Context *ctx) {
+    for (int i = 0; i < GC_MAX_CONTEXTS; i++) {
+        if (!gc.contexts[i]) {
+            gc.contexts[i] = ctx;
+            return;
+        }
+    }
+    assert(0 && "Too many contexts");
+}
+
+
+void gc_untrack_context(Context *ctx) {
+    for (int i = 0; i < GC_MAX_CONTEXTS; i++)
+        if (gc.contexts[i] == ctx)
+            gc.contexts[i] = NULL;
+}
+
+
+void gc_track_stack(struct expr **slots, size_t *size) {
+    for (int i = 0; i < GC_MAX_STACKS; i++) {
+        if (!gc.stacks[i].slots) {
+            gc.stacks[i].slots = slots;
+            gc.stacks[i].size = size;
+            return;
+        }
+    }
+    assert(0 && "Too many stacks");
+}
+
+
+void gc_untrack_stack(struct expr **slots) {
+    for (int i = 0; i < GC_MAX_STACKS; i++)
+        if (gc.stacks[i].slots == slots)
+            gc.stacks[i].slots = NULL;
+}
+
+
+void gc_push_root(struct expr *exp) {
+
+    if (gc.roots_size == gc.roots_capacity) {
+        gc.roots_capacity = gc.roots_capacity ? gc.roots_capacity * 2 : 64;
+        gc.roots = realloc(gc.roots, gc.roots_capacity * sizeof(*gc.roots));
+    }
+
+    gc.roots[gc.roots_size++] = exp;
+}
+
+
+void gc_pop_root(void) {
+    assert(gc.roots_size > 0);
+    gc.roots_size--;
+}
+
+
+static void gc_mark(struct expr *exp) {
+
+    if (!exp || IS_FIXNUM(exp) || (exp->gc & GC_MARKED))
+        return;
+
+    exp->gc |= GC_MARKED;
+
+    /* Only lists, maps, lambdas and sequences need to be traced further */
+    if (exp->etype != SEXP && exp->etype != QEXP && exp->etype != MAP
+        && exp->etype != LAMBDA && exp->etype != SEQ && exp->etype != PROTO)
+        return;
+
+    if (gc.gray_size == gc.gray_capacity) {
+        gc.gray_capacity = gc.gray_capacity ? gc.gray_capacity * 2 : 256;
+        gc.gray = realloc(gc.gray, gc.gray_capacity * sizeof(*gc.gray));
+    }
+
+    gc.gray[gc.gray_size++] = exp;
+}
+
+
+static int gc_mark_entry(struct ht_entry *entry, void *arg) {
+    (void) arg;
+    gc_mark(entry->val);
+    return HASHTABLE_OK;
+}
+
+
+static int gc_mark_int_entry(struct ht_u64_entry *entry, void *arg) {
+    (void) arg;
+    gc_mark(entry->val);
+    return HASHTABLE_OK;
+}
+
+
+/*
+ * Use an explicit gray stack, deeply nested lists must not blow the C stack.
+ * A view keeps its whole base alive, children included.
+ */
+static void gc_trace(void) {
+    while (gc.gray_size > 0) {
+        struct expr *exp = gc.gray[--gc.gray_size];
+        if (exp->etype == MAP) {
+            hashtable_map2(exp->map, gc_mark_entry, NULL);
+            if (MAP_INTS(exp))
+                hashtable_u64_map2(MAP_INTS(exp), gc_mark_int_entry, NULL);
+            continue;
+        }
+        if (exp->etype == PROTO) {
+            gc_mark(exp->proto->chunk.consts);
+            gc_mark(exp->proto->formals);
+            gc_mark(exp->proto->body);
+            continue;
+        }
+        if (LIST(exp)->base) {
+            gc_mark(LIST(exp)->base);
+            continue;
+        }
+        for (int i = 0; i < exp->count; i++)
+            gc_mark(exp->children[i]);
+    }
+}
+
+
+static void gc_sweep_class(struct gc_class *class) {
+
+    struct gc_page **curr = &class->pages;
+
+    class->free_list = NULL;
+
+    while (*curr) {
+
+        struct gc_page *page = *curr;
+        struct expr *head = NULL, *tail = NULL;
+        size_t used = 0;
+
+        for (size_t i = 0; i < page->top; i++) {
+
+            struct expr *exp = GC_SLOT(page, i);
+
+            if (exp->gc & GC_MARKED) {
+                exp->gc &= ~GC_MARKED;
+                used++;
+                continue;
+            }
+
+            if (exp->gc & GC_USED) {
+                expr_release(exp);
+                exp->gc = 0;
+                gc.stats.freed++;
+            }
+
+            exp->next = head;
+            head = exp;
+            if (!tail)
+                tail = exp;
+        }
+
+        /* Give empty pages back, except the one serving the bump pointer */
+        if (used == 0 && page != class->pages) {
+            *curr = page->next;
+            gc.stats.pages--;
+            gc.stats.heap_size -= GC_PAGE_SIZE;
+            free(page);
+            continue;
+        }
+
+        if (tail) {
+            tail->next = class->free_list;
+            class->free_list = head;
+        }
+
+        gc.stats.live += used;
+        gc.stats.live_bytes += used * page->size;
+        curr = &page->next;
+    }
+}
+
+
+static void gc_sweep(void) {
+
+    gc.stats.live = 0;
+    gc.stats.live_bytes = 0;
+
+    for (int i = 0; i < GC_CLASSES; i++)
+        gc_sweep_class(&gc.classes[i]);
+}
+
+
+void gc_collect(void) {
+
+    double start = now_ms();
+
+    for (int i = 0; i < GC_MAX_CONTEXTS; i++) {
+        Context *ctx = gc.contexts[i];
+        for (size_t j = 0; ctx && j < ctx->capacity; j++)
+            gc_mark(ctx->bindings[j].val);
+        for (size_t j = 0; ctx && j < ctx->old_capacity; j++)
+            if (!ctx->old[j].moved)
+                gc_mark(ctx->old[j].val);
+        for (size_t j = 0; ctx && j < ctx->frozen.capacity; j++)
+            gc_mark(ctx->frozen.slots[j].val);
+    }
+
+    for (int i = 0; i < GC_MAX_STACKS; i++)
+        for (size_t j = 0; gc.stacks[i].slots && j < *gc.stacks[i].size; j++)
+            gc_mark(gc.stacks[i].slots[j]);
+
+    for (size_t i = 0; i < gc.roots_size; i++)
+        gc_mark(gc.roots[i]);
+
+    gc_trace();
+    gc_sweep();
+
+    double pause = now_ms() - start;
+
+    gc.stats.collections++;
+    gc.stats.allocated = 0;
+    gc.stats.threshold = gc.stats.live * GC_GROWTH_FACTOR;
+    if (gc.stats.threshold < GC_MIN_THRESHOLD)
+        gc.stats.threshold = GC_MIN_THRESHOLD;
+    gc.stats.last_pause = pause;
+    gc.stats.total_pause += pause;
+    if (pause > gc.stats.max_pause)
+        gc.stats.max_pause = pause;
+}
+
+
+void gc_maybe_collect(void) {
+    if (gc.stats.allocated >= gc.stats.threshold)
+        gc_collect();
+}
+
+
+void gc_stats(struct gc_stats *stats) {
+    *stats = gc.stats;
+}
@@ -0,0 +1,107 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef GC_H
+#define GC_H
+
+#include <stddef.h>
+
+
+/*
+ * Every struct expr is owned by the collector, a node stays alive as long as
+ * it's reachable from one of the roots: the values bound in the registered
+ * contexts, the slots of the registered stacks and the expressions pushed on
+ * the root stack.
+ *
+ * Allocation never triggers a collection, collections only happen at safe
+ * points through gc_maybe_collect, where every live node is known to be
+ * reachable from a root.
+ */
+#define GC_PAGE_SIZE        (64 * 1024)
+#define GC_ALIGN            16
+#define GC_CLASSES          8
+#define GC_MAX_SIZE         (GC_CLASSES * GC_ALIGN)
+#define GC_MIN_THRESHOLD    (16 * 1024)
+#define GC_GROWTH_FACTOR    2
+#define GC_MAX_CONTEXTS     8
+#define GC_MAX_STACKS       4
+
+/* Collector bits stored in every struct expr */
+#define GC_USED             0x01
+#define GC_MARKED           0x02
+
+
+struct expr;
+
+struct context;
+
+
+struct gc_stats {
+    size_t collections;     /* Number of collections run so far */
+    size_t pages;           /* Node pages currently owned by the heap */
+    size_t heap_size;       /* Bytes of node pages */
+    size_t live;            /* Nodes alive after the last collection */
+    size_t live_bytes;      /* Bytes used by the live nodes */
+    size_t allocated;       /* Nodes allocated since the last collection */
+    size_t threshold;       /* Allocations triggering the next collection */
+    size_t freed;           /* Total nodes reclaimed */
+    double last_pause;      /* Duration of the last collection, in ms */
+    double max_pause;
+    double total_pause;
+};
+
+
+/*
+ * Nodes come in size classes, multiple of GC_ALIGN up to GC_MAX_SIZE, each
+ * class is served by its own pages
+ */
+struct expr *gc_alloc(size_t);
+
+/* Values in the context will be considered roots during collections */
+void gc_track_context(struct context *);
+
+void gc_untrack_context(struct context *);
+
+/* Slots [0, *size) of the array will be considered roots during collections */
+void gc_track_stack(struct expr **, size_t *);
+
+void gc_untrack_stack(struct expr **);
+
+void gc_push_root(struct expr *);
+
+void gc_pop_root(void);
+
+/* Run a collection if enough nodes have been allocated since the last one */
+void gc_maybe_collect(void);
+
+void gc_collect(void);
+
+void gc_stats(struct gc_stats *);
+
+
+#endif
@@ -30,474 +30,728 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <assert.h>
 #include "hashtable.h"
 
-
-const int INITIAL_SIZE = 4;
-
-const int MAX_CHAIN_LENGTH = 8;
-
-const unsigned long KNUTH_PRIME = 2654435761;
-
-/* The implementation here was originally done by Gary S. Brown. Slighltly
- * modified by Pete Warden, without any imposition on the reuse of the code.
- */
-
-/* ============================================================= */
-/*  COPYRIGHT (C) 1986 Gary S. Brown.  You may use this program, or       */
-/*  code or tables extracted from it, as desired without restriction.     */
-/*                                                                        */
-/*  First, the polynomial itself and its table of feedback terms.  The    */
-/*  polynomial is                                                         */
-/*  X^32+X^26+X^23+X^22+X^16+X^12+X^11+X^10+X^8+X^7+X^5+X^4+X^2+X^1+X^0   */
-/*                                                                        */
-/*  Note that we take it "backwards" and put the highest-order term in    */
-/*  the lowest-order bit.  The X^32 term is "implied"; the LSB is the     */
-/*  X^31 term, etc.  The X^0 term (usually shown as "+1") results in      */
-/*  the MSB being 1.                                                      */
-/*                                                                        */
-/*  Note that the usual hardware shift register implementation, which     */
-/*  is what we're using (we're merely optimizing it by doing eight-bit    */
-/*  chunks at a time) shifts bits into the lowest-order term.  In our     */
-/*  implementation, that means shifting towards the right.  Why do we     */
-/*  do it this way?  Because the calculated CRC must be transmitted in    */
-/*  order from highest-order term to lowest-order term.  UARTs transmit   */
-/*  characters in order from LSB to MSB.  By storing the CRC this way,    */
-/*  we hand it to the UART in the order low-byte to high-byte; the UART   */
-/*  sends each low-bit to hight-bit; and the result is transmission bit   */
-/*  by bit from highest- to lowest-order term without requiring any bit   */
-/*  shuffling on our part.  Reception works similarly.                    */
-/*                                                                        */
-/*  The feedback terms table consists of 256, 32-bit entries.  Notes:     */
-/*                                                                        */
-/*      The table can be generated at runtime if desired; code to do so   */
-/*      is shown later.  It might not be obvious, but the feedback        */
-/*      terms simply represent the results of eight shift/xor opera-      */
-/*      tions for all combinations of data and CRC register values.       */
-/*                                                                        */
-/*      The values must be right-shifted by eight bits by the "updcrc"    */
-/*      logic; the shift must be unsigned (bring in zeroes).  On some     */
-/*      hardware you could probably optimize the shift in assembler by    */
-/*      using byte-swap instructions.                                     */
-/*      polynomial $edb88320                                              */
-/*                                                                        */
-/*  --------------------------------------------------------------------  */
-
-static unsigned long crc32_tab[] = {
-    0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
-    0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
-    0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L,
-    0x90bf1d91L, 0x1db71064L, 0x6ab020f2L, 0xf3b97148L, 0x84be41deL,
-    0x1adad47dL, 0x6ddde4ebL, 0xf4d4b551L, 0x83d385c7L, 0x136c9856L,
-    0x646ba8c0L, 0xfd62f97aL, 0x8a65c9ecL, 0x14015c4fL, 0x63066cd9L,
-    0xfa0f3d63L, 0x8d080df5L, 0x3b6e20c8L, 0x4c69105eL, 0xd56041e4L,
-    0xa2677172L, 0x3c03e4d1L, 0x4b04d447L, 0xd20d85fdL, 0xa50ab56bL,
-    0x35b5a8faL, 0x42b2986cL, 0xdbbbc9d6L, 0xacbcf940L, 0x32d86ce3L,
-    0x45df5c75L, 0xdcd60dcfL, 0xabd13d59L, 0x26d930acL, 0x51de003aL,
-    0xc8d75180L, 0xbfd06116L, 0x21b4f4b5L, 0x56b3c423L, 0xcfba9599L,
-    0xb8bda50fL, 0x2802b89eL, 0x5f058808L, 0xc60cd9b2L, 0xb10be924L,
-    0x2f6f7c87L, 0x58684c11L, 0xc1611dabL, 0xb6662d3dL, 0x76dc4190L,
-    0x01db7106L, 0x98d220bcL, 0xefd5102aL, 0x71b18589L, 0x06b6b51fL,
-    0x9fbfe4a5L, 0xe8b8d433L, 0x7807c9a2L, 0x0f00f934L, 0x9609a88eL,
-    0xe10e9818L, 0x7f6a0dbbL, 0x086d3d2dL, 0x91646c97L, 0xe6635c01L,
-    0x6b6b51f4L, 0x1c6c6162L, 0x856530d8L, 0xf262004eL, 0x6c0695edL,
-    0x1b01a57bL, 0x8208f4c1L, 0xf50fc457L, 0x65b0d9c6L, 0x12b7e950L,
-    0x8bbeb8eaL, 0xfcb9887cL, 0x62dd1ddfL, 0x15da2d49L, 0x8cd37cf3L,
-    0xfbd44c65L, 0x4db26158L, 0x3ab551ceL, 0xa3bc0074L, 0xd4bb30e2L,
-    0x4adfa541L, 0x3dd895d7L, 0xa4d1c46dL, 0xd3d6f4fbL, 0x4369e96aL,
-    0x346ed9fcL, 0xad678846L, 0xda60b8d0L, 0x44042d73L, 0x33031de5L,
-    0xaa0a4c5fL, 0xdd0d7cc9L, 0x5005713cL, 0x270241aaL, 0xbe0b1010L,
-    0xc90c2086L, 0x5768b525L, 0x206f85b3L, 0xb966d409L, 0xce61e49fL,
-    0x5edef90eL, 0x29d9c998L, 0xb0d09822L, 0xc7d7a8b4L, 0x59b33d17L,
-    0x2eb40d81L, 0xb7bd5c3bL, 0xc0ba6cadL, 0xedb88320L, 0x9abfb3b6L,
-    0x03b6e20cL, 0x74b1d29aL, 0xead54739L, 0x9dd277afL, 0x04db2615L,
-    0x73dc1683L, 0xe3630b12L, 0x94643b84L, 0x0d6d6a3eL, 0x7a6a5aa8L,
-    0xe40ecf0bL, 0x9309ff9dL, 0x0a00ae27L, 0x7d079eb1L, 0xf00f9344L,
-    0x8708a3d2L, 0x1e01f268L, 0x6906c2feL, 0xf762575dL, 0x806567cbL,
-    0x196c3671L, 0x6e6b06e7L, 0xfed41b76L, 0x89d32be0L, 0x10da7a5aL,
-    0x67dd4accL, 0xf9b9df6fL, 0x8ebeeff9L, 0x17b7be43L, 0x60b08ed5L,
-    0xd6d6a3e8L, 0xa1d1937eL, 0x38d8c2c4L, 0x4fdff252L, 0xd1bb67f1L,
-    0xa6bc5767L, 0x3fb506ddL, 0x48b2364bL, 0xd80d2bdaL, 0xaf0a1b4cL,
-    0x36034af6L, 0x41047a60L, 0xdf60efc3L, 0xa867df55L, 0x316e8eefL,
-    0x4669be79L, 0xcb61b38cL, 0xbc66831aL, 0x256fd2a0L, 0x5268e236L,
-    0xcc0c7795L, 0xbb0b4703L, 0x220216b9L, 0x5505262fL, 0xc5ba3bbeL,
-    0xb2bd0b28L, 0x2bb45a92L, 0x5cb36a04L, 0xc2d7ffa7L, 0xb5d0cf31L,
-    0x2cd99e8bL, 0x5bdeae1dL, 0x9b64c2b0L, 0xec63f226L, 0x756aa39cL,
-    0x026d930aL, 0x9c0906a9L, 0xeb0e363fL, 0x72076785L, 0x05005713L,
-    0x95bf4a82L, 0xe2b87a14L, 0x7bb12baeL, 0x0cb61b38L, 0x92d28e9bL,
-    0xe5d5be0dL, 0x7cdcefb7L, 0x0bdbdf21L, 0x86d3d2d4L, 0xf1d4e242L,
-    0x68ddb3f8L, 0x1fda836eL, 0x81be16cdL, 0xf6b9265bL, 0x6fb077e1L,
-    0x18b74777L, 0x88085ae6L, 0xff0f6a70L, 0x66063bcaL, 0x11010b5cL,
-    0x8f659effL, 0xf862ae69L, 0x616bffd3L, 0x166ccf45L, 0xa00ae278L,
-    0xd70dd2eeL, 0x4e048354L, 0x3903b3c2L, 0xa7672661L, 0xd06016f7L,
-    0x4969474dL, 0x3e6e77dbL, 0xaed16a4aL, 0xd9d65adcL, 0x40df0b66L,
-    0x37d83bf0L, 0xa9bcae53L, 0xdebb9ec5L, 0x47b2cf7fL, 0x30b5ffe9L,
-    0xbdbdf21cL, 0xcabac28aL, 0x53b39330L, 0x24b4a3a6L, 0xbad03605L,
-    0xcdd70693L, 0x54de5729L, 0x23d967bfL, 0xb3667a2eL, 0xc4614ab8L,
-    0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
-    0x2d02ef8dL
-};
-
-/* Return a 32-bit CRC of the contents of the buffer. */
-static unsigned long crc32(const unsigned *s, unsigned int len) {
-    unsigned int i;
-    uint64_t crc32val;
-
-    crc32val = 0LL;
-    for (i = 0;  i < len;  i ++) {
-        crc32val = crc32_tab[(crc32val ^ s[i]) & 0xff] ^ (crc32val >> 8);
-    }
-    return crc32val;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+/* The table is never smaller than a group of control bytes */
+const int INITIAL_SIZE = HT_GROUP_SIZE;
+
+/* Multipliers of the hash, odd constants with well spread bits */
+#define HASH_P0     0xa0761d6478bd642fULL
+#define HASH_P1     0xe7037ed1a0b428dbULL
+#define HASH_P2     0x8ebc6af09c88c6e3ULL
+
+
+/* Multiply to 128 bits and fold the halves back together */
+static inline uint64_t hash_mum(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    __extension__ typedef unsigned __int128 uint128;
+    uint128 r = (uint128) a * b;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+#else
+    uint64_t ha = a >> 32, la = (uint32_t) a;
+    uint64_t hb = b >> 32, lb = (uint32_t) b;
+    uint64_t hh = ha * hb, hl = ha * lb, lh = la * hb, ll = la * lb;
+    uint64_t mid = (ll >> 32) + (uint32_t) hl + (uint32_t) lh;
+    uint64_t lo = (mid << 32) | (uint32_t) ll;
+    uint64_t hi = hh + (hl >> 32) + (lh >> 32) + (mid >> 32);
+    return lo ^ hi;
+#endif
 }
 
-/*
- * Hashing function for a string
- */
-static uint64_t hashtable_hash_int(HashTable *m, const unsigned *keystr) {
-
-    assert(m && keystr);
-
-    uint64_t key = crc32(keystr, strlen((const char *) keystr));
 
-    /* Robert Jenkins' 32 bit Mix Function */
-    key += (key << 12);
-    key ^= (key >> 22);
-    key += (key << 4);
-    key ^= (key >> 9);
-    key += (key << 10);
-    key ^= (key >> 2);
-    key += (key << 7);
-    key ^= (key >> 12);
-
-    /* Knuth's Multiplicative Method */
-    key = (key >> 3) * KNUTH_PRIME;
-
-    return key % m->table_size;
+static inline uint64_t hash_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
 }
 
-/*
- * Return the integer of the location in entries to store the point to the item
- * or -HASHTABLE_FULL.
- */
-static int hashtable_hash(HashTable *table, const unsigned *key) {
-
-    assert(table && key);
-
-    /* If full, return immediately */
-    if (table->size >= (table->table_size / 2))
-        return -HASHTABLE_FULL;
-
-    /* Find the best index */
-    uint64_t curr = hashtable_hash_int(table, key);
-    char *k, *currk;
-
-    /* Linear probing */
-    for (int i = 0; i < MAX_CHAIN_LENGTH; i++) {
-
-        if (!table->entries[curr].taken)
-            return curr;
-
-        k = (char *) table->entries[curr].key;
-        currk = (char *) key;
 
-        if (table->entries[curr].taken &&
-            strncmp(k, currk, strlen(k)) == 0)
-            return curr;
-
-        curr = (curr + 1) % table->table_size;
-    }
-
-    return -HASHTABLE_FULL;
+static inline uint64_t hash_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
 }
 
+
 /*
- * Doubles the size of the hashtable, and rehashes all the elements
+ * Word at a time hash, in the style of wyhash: 16 bytes are consumed per
+ * round, short keys are covered by at most four overlapping reads, never
+ * past the end of the key.
  */
-static int hashtable_rehash(HashTable *table) {
-
-    assert(table);
-
-    size_t old_size;
-    struct ht_entry *curr;
-
-    /* Setup the new elements */
-    struct ht_entry *tmp = calloc(2 * table->table_size, sizeof(*tmp));
-
-    if (!tmp)
-        return -HASHTABLE_ERR;
-
-    /* Update the array */
-    curr = table->entries;
-    table->entries = tmp;
-
-    /* Update the size */
-    old_size = table->table_size;
-    table->table_size = 2 * table->table_size;
-    table->size = 0;
-
-    int status;
-
-    /* Rehash the elements */
-    for (size_t i = 0; i < old_size; i++) {
-
-        if (!curr[i].taken)
-            continue;
-
-        if ((status = hashtable_put(table, curr[i].key,
-                                    curr[i].val)) != HASHTABLE_OK)
-            return status;
+static uint64_t hash_bytes(const void *key, size_t len, uint64_t seed) {
+
+    const unsigned char *p = key;
+    uint64_t a, b;
+
+    seed ^= HASH_P0;
+
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t off = (len >> 3) << 2;
+            const unsigned char *q = p + len - 4;
+            a = (hash_read32(p) << 32) | hash_read32(p + off);
+            b = (hash_read32(q) << 32) | hash_read32(q - off);
+        } else if (len > 0) {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8);
+            a |= p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        while (i > 16) {
+            seed = hash_mum(hash_read64(p) ^ HASH_P1,
+                            hash_read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = hash_read64(p + i - 16);
+        b = hash_read64(p + i - 8);
     }
 
-    free(curr);
-
-    return HASHTABLE_OK;
-}
-
-/* callback function used with iterate to clean up the hashtable */
-static int destroy_entry(struct ht_entry *entry) {
-
-    if (!entry)
-        return -HASHTABLE_ERR;
-
-    // free key field
-    if (entry->key)
-        free((void *) entry->key);
-
-    // free value field
-    if (entry->val)
-        free(entry->val);
-
-    return HASHTABLE_OK;
+    return hash_mum(HASH_P1 ^ len, hash_mum(a ^ HASH_P1, b ^ seed));
 }
 
 
 /*
- * Return an empty hashtable, or NULL on failure. The newly create HashTable is
- * dynamically allocated on the heap memory, so it must be released manually.
+ * Every table gets its own seed, so that colliding keys can't be crafted once
+ * for all the tables of the process
  */
-HashTable *hashtable_create(ht_unary_fun *destructor) {
-
-    HashTable *table = malloc(sizeof(HashTable));
-    if(!table)
-        return NULL;
-
-    hashtable_init(table, destructor);
-
-    return table;
-}
-
-
-void hashtable_init(HashTable *table, ht_unary_fun *destructor) {
-    table->entries = calloc(INITIAL_SIZE, sizeof(struct ht_entry));
-    if(!table->entries) {
-        hashtable_release(table);
-        return;
-    }
-
-    table->destructor = destructor ? destructor : destroy_entry;
-
-    table->table_size = INITIAL_SIZE;
-    table->size = 0;
+uint64_t hashtable_seed(const void *table) {
+    static uint64_t counter;
+    uint64_t t = (uint64_t) time(NULL) ^ (uint64_t) clock();
+    return hash_mum(t ^ HASH_P2, (uintptr_t) table ^ ++counter ^ HASH_P0);
 }
 
 
-size_t hashtable_size(const HashTable *table) {
-    return table->size;
-}
-
-/* Add a new key-value pair into the hashtable entries array, use chaining in
-   case of collision. */
-int hashtable_put(HashTable *table, const char *key, void *val) {
-
-    assert(table && key);
-
-    /* Find a place to put our value */
-    int index = hashtable_hash(table, (const unsigned *) key);
-
-    while (index == -HASHTABLE_FULL) {
-
-        if (hashtable_rehash(table) == -HASHTABLE_ERR)
-            return -HASHTABLE_ERR;
-
-        index = hashtable_hash(table, (const unsigned *) key);
-    }
-
-    /* Set the entries */
-    table->entries[index].val = val;
-    table->entries[index].key = key;
-
-    /* Update taken flag, if it was false, update the size also */
-    if (!table->entries[index].taken) {
-        table->entries[index].taken = true;
-        table->size++;
-    }
-
-    return HASHTABLE_OK;
+uint64_t hashtable_hash(const char *key, uint64_t seed) {
+    return hash_bytes(key, strlen(key), seed);
 }
 
 
 /*
- * Get the value void pointer out of the hashtable associated to a key
+ * Integer keys are mixed with a single multiplication, they compare as plain
+ * values
  */
-void *hashtable_get(HashTable *table, const char *key) {
-
-    assert(table && key);
-
-    /* Find data location */
-    uint64_t curr = hashtable_hash_int(table, (const unsigned *) key);
-
-    /* Linear probing, if necessary */
-    for (int i = 0; i < MAX_CHAIN_LENGTH; i++){
-        if (table->entries[curr].taken) {
-            if (strncmp(table->entries[curr].key, key, strlen(key)) == 0)
-                return table->entries[curr].val;
-        }
-        curr = (curr + 1) % table->table_size;
-    }
-
-    /* Not found */
-    return NULL;
+static inline uint64_t hash_u64(uint64_t key, uint64_t seed) {
+    return hash_mum(key ^ HASH_P0, seed ^ HASH_P1);
 }
 
 
-/*
- * Return the key-value pair represented by a key in the hashtable
- */
-struct ht_entry *hashtable_get_entry(HashTable *table, const char *key) {
-
-    assert(table && key);
-
-    /* Find data location */
-    uint64_t curr = hashtable_hash_int(table, (const unsigned *) key);
-
-    /* Linear probing, if necessary */
-    for (int i = 0; i < MAX_CHAIN_LENGTH; i++) {
-        if (table->entries[curr].taken) {
-            if (strncmp(table->entries[curr].key, key, strlen(key)) == 0)
-                return &table->entries[curr];
-        }
+#define HASH_STR(key, seed)     hashtable_hash(key, seed)
+#define HASH_U64(key, seed)     hash_u64(key, seed)
 
-        curr = (curr + 1) % table->table_size;
-    }
+#define EQ_STR(a, b)            (strcmp(a, b) == 0)
+#define EQ_VAL(a, b)            ((a) == (b))
 
-    /* Not found */
-    return NULL;
-}
+#define FREE_KEY(key)           free((void *) (key))
+#define KEEP_KEY(key)           (void) (key)
 
 
 /*
- * Remove an element with that key from the hashtable
+ * Every slot has a control byte: the 7 low bits of the hash when the slot is
+ * taken, CTRL_EMPTY otherwise. Lookups compare a whole group of control bytes
+ * at once against the 7 bits of the key, only matching slots are compared
+ * with the full hash and the key.
+ *
+ * Slots are placed with Robin Hood linear probing: an insertion takes the
+ * slot of any element closer to its home than the new one is, which keeps
+ * probe lengths short and even at high load. A key is always found before
+ * the first empty slot after its home, so no tombstones are needed: deletion
+ * shifts the following displaced elements back by one.
+ *
+ * During a resize the slots already moved out of the old table are marked
+ * CTRL_MOVED, neither full nor empty, probes go past them.
  */
-int hashtable_del(HashTable *table, const char *key) {
-
-    assert(table && key);
-
-    /* Find key */
-    uint64_t curr = hashtable_hash_int(table, (const unsigned *) key);
-
-    /* Linear probing, if necessary */
-    for (int i = 0; i < MAX_CHAIN_LENGTH; i++) {
+#define CTRL_EMPTY      0x80
+#define CTRL_MOVED      0xFE
 
-        // check wether the position in array is in use
-        if (table->entries[curr].taken) {
-            if (strncmp(table->entries[curr].key, key, strlen(key)) == 0) {
+#define H1(hash)        ((hash) >> 7)
+#define H2(hash)        ((unsigned char) ((hash) & 0x7F))
 
-                /* Blank out the fields */
-                table->entries[curr].taken = false;
+#define IS_FULL(c)      (((c) & 0x80) == 0)
 
-                /* Reduce the size */
-                table->size--;
 
-                /* Destroy the entry */
-                table->destructor(&table->entries[curr]);
+#ifdef __SSE2__
 
-                return HASHTABLE_OK;
-            }
-        }
-
-        curr = (curr + 1) % table->table_size;
-    }
-
-    /* Data not found */
-    return -HASHTABLE_ERR;
+static inline unsigned group_match(const unsigned char *ctrl, unsigned char c) {
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
 }
 
-/*
- * Iterate the function parameter over each element in the hashmap. The unique
- * void * argument is passed to the function as its first argument,
- * representing the key-value pair structure.
- */
-int hashtable_map(HashTable *table, ht_unary_fun *func) {
-
-    assert(func);
+#else
 
-    /* On empty hashmap, return immediately */
-    if (!table || table->size <= 0)
-        return -HASHTABLE_ERR;
-
-    /* Linear probing */
-    for (size_t i = 0; i < table->table_size; i++) {
-
-        if (table->entries[i].taken) {
+static inline unsigned group_match(const unsigned char *ctrl, unsigned char c) {
+    unsigned mask = 0;
+    for (int i = 0; i < HT_GROUP_SIZE; i++)
+        mask |= (unsigned) (ctrl[i] == c) << i;
+    return mask;
+}
 
-            /* Apply function to the key-value entry */
-            struct ht_entry data = table->entries[i];
-            int status = func(&data);
+#endif
 
-            if (status != HASHTABLE_OK)
-                return status;
 
-        }
+/* Index of the lowest bit set in a non zero mask */
+static inline int mask_first(unsigned mask) {
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
     }
-
-    return HASHTABLE_OK;
+    return i;
+#endif
 }
 
-/*
- * Iterate through all key-value pairs in the hashtable, accept a functor as
- * parameter to apply function to each pair with an additional parameter
- */
-int hashtable_map2(HashTable *table, ht_binary_fun *func, void *param) {
 
-    assert(func);
-
-    /* On empty hashmap, return immediately */
-    if (!table || table->size <= 0)
-        return -HASHTABLE_ERR;
-
-    /* Linear probing */
-    for (size_t i = 0; i < table->table_size; i++) {
-
-        if (table->entries[i].taken) {
-
-            /* Apply function to the key-value entry */
-            struct ht_entry data = table->entries[i];
-            int status = func(&data, param);
-
-            if (status != HASHTABLE_OK)
-                return status;
-
-        }
-    }
-
-    return HASHTABLE_OK;
-}
 
 /*
- * Deallocate the hashtable using the defined destructor, if the destructor is
- * NULL it call normal free on key-value pairs.
+ * The whole table is generated for each type of key, keys are hashed with
+ * HASH(key, seed) and compared with EQ(a, b), both expanded inline in the
+ * probes. The default destructor frees the value and calls KEY_FREE on the
+ * key. tp prefixes the types and the internal functions, fp the API.
  */
-void hashtable_release(HashTable *table) {
-
-    if (!table)
-        return;
+#define HT_DEFINE(tp, fp, Type, key_t, HASH, EQ, KEY_FREE)                     \
+                                                                               \
+/*                                                                             \
+ * Groups are read unaligned at any slot, the first group of control bytes is  \
+ * cloned past the end of the table so that a read never wraps around.         \
+ */                                                                            \
+static inline void tp##_set_ctrl(struct tp##_table *t,                         \
+                                 size_t i, unsigned char c) {                  \
+    t->ctrl[i] = c;                                                            \
+    if (i < HT_GROUP_SIZE)                                                     \
+        t->ctrl[t->table_size + i] = c;                                        \
+}                                                                              \
+                                                                               \
+                                                                               \
+static inline size_t tp##_home(const struct tp##_table *t, uint64_t hash) {    \
+    return H1(hash) & (t->table_size - 1);                                     \
+}                                                                              \
+                                                                               \
+                                                                               \
+/* Distance of the element in slot i from its home slot */                     \
+static inline size_t tp##_distance(const struct tp##_table *t, size_t i) {     \
+    return (i - tp##_home(t, t->entries[i].hash)) & (t->table_size - 1);       \
+}                                                                              \
+                                                                               \
+                                                                               \
+/*                                                                             \
+ * Find the slot holding a key, -1 if it's missing. Groups are scanned from    \
+ * the home slot up to the first empty slot, or to the longest displacement    \
+ * in the table.                                                               \
+ */                                                                            \
+static long tp##_find(const struct tp##_table *t, key_t key, uint64_t hash) {  \
+                                                                               \
+    size_t mask = t->table_size - 1;                                           \
+    size_t pos = tp##_home(t, hash);                                           \
+                                                                               \
+    for (size_t dist = 0; dist <= t->max_probe; dist += HT_GROUP_SIZE) {       \
+                                                                               \
+        const unsigned char *group = t->ctrl + ((pos + dist) & mask);          \
+        unsigned match = group_match(group, H2(hash));                         \
+        unsigned empty = group_match(group, CTRL_EMPTY);                       \
+                                                                               \
+        /* Only slots before the first empty one can hold the key */           \
+        if (empty)                                                             \
+            match &= (1u << mask_first(empty)) - 1;                            \
+                                                                               \
+        for (; match; match &= match - 1) {                                    \
+            size_t i = (pos + dist + mask_first(match)) & mask;                \
+            const struct tp##_entry *entry = &t->entries[i];                   \
+            if (entry->hash == hash && EQ(entry->key, key))                    \
+                return i;                                                      \
+        }                                                                      \
+                                                                               \
+        if (empty)                                                             \
+            break;                                                             \
+    }                                                                          \
+                                                                               \
+    return -1;                                                                 \
+}                                                                              \
+                                                                               \
+                                                                               \
+/*                                                                             \
+ * Place an entry known to be missing, Robin Hood style, starting from slot i  \
+ * at distance dist from its home.                                             \
+ */                                                                            \
+static void tp##_place(struct tp##_table *t,                                   \
+                       struct tp##_entry entry, size_t i, size_t dist) {       \
+                                                                               \
+    size_t mask = t->table_size - 1;                                           \
+                                                                               \
+    while (IS_FULL(t->ctrl[i])) {                                              \
+                                                                               \
+        size_t other = tp##_distance(t, i);                                    \
+                                                                               \
+        /* Take from the rich, the element closer to home moves on */          \
+        if (other < dist) {                                                    \
+            struct tp##_entry tmp = t->entries[i];                             \
+            t->entries[i] = entry;                                             \
+            tp##_set_ctrl(t, i, H2(entry.hash));                               \
+            if (dist > t->max_probe)                                           \
+                t->max_probe = dist;                                           \
+            entry = tmp;                                                       \
+            dist = other;                                                      \
+        }                                                                      \
+                                                                               \
+        i = (i + 1) & mask;                                                    \
+        dist++;                                                                \
+    }                                                                          \
+                                                                               \
+    t->entries[i] = entry;                                                     \
+    tp##_set_ctrl(t, i, H2(entry.hash));                                       \
+    if (dist > t->max_probe)                                                   \
+        t->max_probe = dist;                                                   \
+                                                                               \
+    t->size++;                                                                 \
+}                                                                              \
+                                                                               \
+                                                                               \
+/* Empty slot i, shifting back the elements displaced past it */               \
+static void tp##_remove(struct tp##_table *t, size_t i) {                      \
+                                                                               \
+    size_t mask = t->table_size - 1;                                           \
+    size_t next = (i + 1) & mask;                                              \
+                                                                               \
+    while (IS_FULL(t->ctrl[next]) && tp##_distance(t, next) > 0) {             \
+        t->entries[i] = t->entries[next];                                      \
+        tp##_set_ctrl(t, i, t->ctrl[next]);                                    \
+        i = next;                                                              \
+        next = (next + 1) & mask;                                              \
+    }                                                                          \
+                                                                               \
+    tp##_set_ctrl(t, i, CTRL_EMPTY);                                           \
+                                                                               \
+    t->size--;                                                                 \
+}                                                                              \
+                                                                               \
+                                                                               \
+/* Keep at least 1/8 of the slots empty, Robin Hood stays fast up to there */  \
+static inline size_t tp##_capacity(const struct tp##_table *t) {               \
+    return t->table_size - t->table_size / 8;                                  \
+}                                                                              \
+                                                                               \
+                                                                               \
+static int tp##_alloc(struct tp##_table *t, size_t table_size) {               \
+                                                                               \
+    struct tp##_entry *entries = calloc(table_size, sizeof(*entries));         \
+    unsigned char *ctrl = malloc(table_size + HT_GROUP_SIZE);                  \
+                                                                               \
+    if (!entries || !ctrl) {                                                   \
+        free(entries);                                                         \
+        free(ctrl);                                                            \
+        return -HASHTABLE_OOM;                                                 \
+    }                                                                          \
+                                                                               \
+    memset(ctrl, CTRL_EMPTY, table_size + HT_GROUP_SIZE);                      \
+                                                                               \
+    t->entries = entries;                                                      \
+    t->ctrl = ctrl;                                                            \
+    t->table_size = table_size;                                                \
+    t->size = 0;                                                               \
+    t->max_probe = 0;                                                          \
+                                                                               \
+    return HASHTABLE_OK;                                                       \
+}                                                                              \
+                                                                               \
+                                                                               \
+static void tp##_free(struct tp##_table *t) {                                  \
+    free(t->entries);                                                          \
+    free(t->ctrl);                                                             \
+    t->entries = NULL;                                                         \
+    t->ctrl = NULL;                                                            \
+    t->table_size = t->size = 0;                                               \
+}                                                                              \
+                                                                               \
+                                                                               \
+static inline bool fp##_rehashing(const Type *table) {                         \
+    return table->old.entries != NULL;                                         \
+}                                                                              \
+                                                                               \
+                                                                               \
+/*                                                                             \
+ * Move up to n elements from the old table to the new one, visiting at most   \
+ * HT_REHASH_VISITS slots for each of them. Moved slots are marked instead of  \
+ * emptied, so that probes in the old table still go past them.                \
+ */                                                                            \
+int fp##_rehash_step(Type *table, size_t n) {                                  \
+                                                                               \
+    assert(table);                                                             \
+                                                                               \
+    struct tp##_table *old = &table->old;                                      \
+                                                                               \
+    if (!fp##_rehashing(table))                                                \
+        return 0;                                                              \
+                                                                               \
+    size_t visits = n * HT_REHASH_VISITS;                                      \
+                                                                               \
+    while (n > 0 && visits-- > 0 && old->size > 0) {                           \
+                                                                               \
+        size_t i = table->rehash_idx++;                                        \
+                                                                               \
+        if (!IS_FULL(old->ctrl[i]))                                            \
+            continue;                                                          \
+                                                                               \
+        struct tp##_entry *entry = &old->entries[i];                           \
+        tp##_place(&table->tab, *entry,                                        \
+                   tp##_home(&table->tab, entry->hash), 0);                    \
+        tp##_set_ctrl(old, i, CTRL_MOVED);                                     \
+        old->size--;                                                           \
+        n--;                                                                   \
+    }                                                                          \
+                                                                               \
+    if (old->size > 0)                                                         \
+        return 1;                                                              \
+                                                                               \
+    tp##_free(old);                                                            \
+                                                                               \
+    return 0;                                                                  \
+}                                                                              \
+                                                                               \
+                                                                               \
+/*                                                                             \
+ * Start moving the elements to a table twice the size. Hashes are cached in   \
+ * the entries and never recomputed, elements are moved a few at a time by     \
+ * the following operations, see rehash_step.                                  \
+ */                                                                            \
+static int fp##_grow(Type *table) {                                            \
+                                                                               \
+    assert(table);                                                             \
+                                                                               \
+    /* The previous resize didn't keep up, finish it first */                  \
+    while (fp##_rehash_step(table, table->old.size))                           \
+        ;                                                                      \
+                                                                               \
+    struct tp##_table tab = table->tab;                                        \
+                                                                               \
+    if (tp##_alloc(&table->tab, 2 * tab.table_size) != HASHTABLE_OK) {         \
+        table->tab = tab;                                                      \
+        return -HASHTABLE_ERR;                                                 \
+    }                                                                          \
+                                                                               \
+    table->old = tab;                                                          \
+    table->rehash_idx = 0;                                                     \
+                                                                               \
+    return HASHTABLE_OK;                                                       \
+}                                                                              \
+                                                                               \
+                                                                               \
+/* Find the entry of a key in either of the tables, NULL if it's missing */    \
+static struct tp##_entry *fp##_lookup(Type *table,                             \
+                                      key_t key, uint64_t hash) {              \
+                                                                               \
+    long i = tp##_find(&table->tab, key, hash);                                \
+    if (i >= 0)                                                                \
+        return &table->tab.entries[i];                                         \
+                                                                               \
+    if (fp##_rehashing(table)) {                                               \
+        i = tp##_find(&table->old, key, hash);                                 \
+        if (i >= 0)                                                            \
+            return &table->old.entries[i];                                     \
+    }                                                                          \
+                                                                               \
+    return NULL;                                                               \
+}                                                                              \
+                                                                               \
+                                                                               \
+/* callback function used with iterate to clean up the hashtable */            \
+static int tp##_destroy_entry(struct tp##_entry *entry) {                      \
+                                                                               \
+    if (!entry)                                                                \
+        return -HASHTABLE_ERR;                                                 \
+                                                                               \
+    KEY_FREE(entry->key);                                                      \
+                                                                               \
+    if (entry->val)                                                            \
+        free(entry->val);                                                      \
+                                                                               \
+    return HASHTABLE_OK;                                                       \
+}                                                                              \
+                                                                               \
+                                                                               \
+/*                                                                             \
+ * Return an empty hashtable, or NULL on failure. The newly create table is    \
+ * dynamically allocated on the heap memory, so it must be released manually.  \
+ */                                                                            \
+Type *fp##_create(tp##_unary_fun *destructor) {                                \
+                                                                               \
+    Type *table = malloc(sizeof(Type));                                        \
+    if(!table)                                                                 \
+        return NULL;                                                           \
+                                                                               \
+    fp##_init(table, destructor);                                              \
+                                                                               \
+    return table;                                                              \
+}                                                                              \
+                                                                               \
+                                                                               \
+void fp##_init(Type *table, tp##_unary_fun *destructor) {                      \
+                                                                               \
+    table->destructor = destructor ? destructor : tp##_destroy_entry;          \
+    table->seed = hashtable_seed(table);                                       \
+    table->old = (struct tp##_table) {0};                                      \
+    table->rehash_idx = 0;                                                     \
+                                                                               \
+    if (tp##_alloc(&table->tab, INITIAL_SIZE) != HASHTABLE_OK) {               \
+        fp##_release(table);                                                   \
+        return;                                                                \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+                                                                               \
+size_t fp##_size(const Type *table) {                                          \
+    return table->tab.size + table->old.size;                                  \
+}                                                                              \
+                                                                               \
+                                                                               \
+/*                                                                             \
+ * Add a new key-value pair into the hashtable, or update its value. A single  \
+ * walk from the home slot finds the key, or proves it missing as soon as an   \
+ * empty slot or an element closer to its home is met.                         \
+ */                                                                            \
+int fp##_put(Type *table, key_t key, void *val) {                              \
+                                                                               \
+    assert(table);                                                             \
+                                                                               \
+    fp##_rehash_step(table, HT_REHASH_STEP);                                   \
+                                                                               \
+    struct tp##_table *t = &table->tab;                                        \
+    uint64_t hash = HASH(key, table->seed);                                    \
+    size_t mask = t->table_size - 1;                                           \
+    size_t i = tp##_home(t, hash);                                             \
+    size_t dist = 0;                                                           \
+                                                                               \
+    while (IS_FULL(t->ctrl[i]) && tp##_distance(t, i) >= dist) {               \
+        struct tp##_entry *entry = &t->entries[i];                             \
+        if (entry->hash == hash && EQ(entry->key, key)) {                      \
+            entry->key = key;                                                  \
+            entry->val = val;                                                  \
+            return HASHTABLE_OK;                                               \
+        }                                                                      \
+        i = (i + 1) & mask;                                                    \
+        dist++;                                                                \
+    }                                                                          \
+                                                                               \
+    /* Not moved yet */                                                        \
+    if (fp##_rehashing(table)) {                                               \
+        long j = tp##_find(&table->old, key, hash);                            \
+        if (j >= 0) {                                                          \
+            table->old.entries[j].key = key;                                   \
+            table->old.entries[j].val = val;                                   \
+            return HASHTABLE_OK;                                               \
+        }                                                                      \
+    }                                                                          \
+                                                                               \
+    if (t->size + 1 > tp##_capacity(t)) {                                      \
+        if (fp##_grow(table) != HASHTABLE_OK)                                  \
+            return -HASHTABLE_ERR;                                             \
+        i = tp##_home(t, hash);                                                \
+        dist = 0;                                                              \
+    }                                                                          \
+                                                                               \
+    tp##_place(t, (struct tp##_entry) { key, val, hash }, i, dist);            \
+                                                                               \
+    return HASHTABLE_OK;                                                       \
+}                                                                              \
+                                                                               \
+                                                                               \
+/*                                                                             \
+ * Get the value void pointer out of the hashtable associated to a key         \
+ */                                                                            \
+void *fp##_get(Type *table, key_t key) {                                       \
+                                                                               \
+    assert(table);                                                             \
+                                                                               \
+    fp##_rehash_step(table, HT_REHASH_STEP);                                   \
+                                                                               \
+    struct tp##_entry *entry =                                                 \
+        fp##_lookup(table, key, HASH(key, table->seed));                       \
+                                                                               \
+    return entry ? entry->val : NULL;                                          \
+}                                                                              \
+                                                                               \
+                                                                               \
+/*                                                                             \
+ * Return the key-value pair represented by a key in the hashtable             \
+ */                                                                            \
+struct tp##_entry *fp##_get_entry(Type *table, key_t key) {                    \
+                                                                               \
+    assert(table);                                                             \
+                                                                               \
+    fp##_rehash_step(table, HT_REHASH_STEP);                                   \
+                                                                               \
+    return fp##_lookup(table, key, HASH(key, table->seed));                    \
+}                                                                              \
+                                                                               \
+                                                                               \
+/*                                                                             \
+ * Remove an element with that key from the hashtable                          \
+ */                                                                            \
+int fp##_del(Type *table, key_t key) {                                         \
+                                                                               \
+    assert(table);                                                             \
+                                                                               \
+    fp##_rehash_step(table, HT_REHASH_STEP);                                   \
+                                                                               \
+    uint64_t hash = HASH(key, table->seed);                                    \
+    struct tp##_table *t = &table->tab;                                        \
+    long i = tp##_find(t, key, hash);                                          \
+                                                                               \
+    if (i < 0 && fp##_rehashing(table)) {                                      \
+        t = &table->old;                                                       \
+        i = tp##_find(t, key, hash);                                           \
+    }                                                                          \
+                                                                               \
+    /* Data not found */                                                       \
+    if (i < 0)                                                                 \
+        return -HASHTABLE_ERR;                                                 \
+                                                                               \
+    /* Destroy the entry */                                                    \
+    table->destructor(&t->entries[i]);                                         \
+                                                                               \
+    /* The old table is only emptied by moves, see rehash_step */              \
+    if (t == &table->old) {                                                    \
+        tp##_set_ctrl(t, i, CTRL_MOVED);                                       \
+        t->size--;                                                             \
+    } else {                                                                   \
+        tp##_remove(t, i);                                                     \
+    }                                                                          \
+                                                                               \
+    return HASHTABLE_OK;                                                       \
+}                                                                              \
+                                                                               \
+                                                                               \
+static void tp##_probe_stats(const struct tp##_table *t,                       \
+                             size_t *total, size_t *max) {                     \
+    for (size_t i = 0; i < t->table_size; i++) {                               \
+        if (!IS_FULL(t->ctrl[i]))                                              \
+            continue;                                                          \
+        size_t probes = tp##_distance(t, i) + 1;                               \
+        *total += probes;                                                      \
+        if (probes > *max)                                                     \
+            *max = probes;                                                     \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+                                                                               \
+void fp##_probe_stats(const Type *table, struct ht_probe_stats *st) {          \
+                                                                               \
+    size_t size = fp##_size(table);                                            \
+    size_t total = 0;                                                          \
+                                                                               \
+    st->max = 0;                                                               \
+                                                                               \
+    tp##_probe_stats(&table->tab, &total, &st->max);                           \
+    tp##_probe_stats(&table->old, &total, &st->max);                           \
+                                                                               \
+    st->mean = size ? (double) total / size : 0.0;                             \
+    st->load = (double) size / table->tab.table_size;                          \
+}                                                                              \
+                                                                               \
+                                                                               \
+/*                                                                             \
+ * Iterate the function parameter over each element in the hashmap. The unique \
+ * void * argument is passed to the function as its first argument,            \
+ * representing the key-value pair structure.                                  \
+ */                                                                            \
+int fp##_map(Type *table, tp##_unary_fun *func) {                              \
+                                                                               \
+    assert(func);                                                              \
+                                                                               \
+    /* On empty hashmap, return immediately */                                 \
+    if (!table || fp##_size(table) == 0)                                       \
+        return -HASHTABLE_ERR;                                                 \
+                                                                               \
+    /* Both tables are live during a resize */                                 \
+    struct tp##_table *tabs[] = { &table->tab, &table->old };                  \
+                                                                               \
+    for (int t = 0; t < 2; t++) {                                              \
+        for (size_t i = 0; i < tabs[t]->table_size; i++) {                     \
+                                                                               \
+            if (IS_FULL(tabs[t]->ctrl[i])) {                                   \
+                                                                               \
+                /* Apply function to the key-value entry */                    \
+                struct tp##_entry data = tabs[t]->entries[i];                  \
+                int status = func(&data);                                      \
+                                                                               \
+                if (status != HASHTABLE_OK)                                    \
+                    return status;                                             \
+                                                                               \
+            }                                                                  \
+        }                                                                      \
+    }                                                                          \
+                                                                               \
+    return HASHTABLE_OK;                                                       \
+}                                                                              \
+                                                                               \
+                                                                               \
+/*                                                                             \
+ * Iterate through all key-value pairs in the hashtable, accept a functor as   \
+ * parameter to apply function to each pair with an additional parameter       \
+ */                                                                            \
+int fp##_map2(Type *table, tp##_binary_fun *func, void *param) {               \
+                                                                               \
+    assert(func);                                                              \
+                                                                               \
+    /* On empty hashmap, return immediately */                                 \
+    if (!table || fp##_size(table) == 0)                                       \
+        return -HASHTABLE_ERR;                                                 \
+                                                                               \
+    /* Both tables are live during a resize */                                 \
+    struct tp##_table *tabs[] = { &table->tab, &table->old };                  \
+                                                                               \
+    for (int t = 0; t < 2; t++) {                                              \
+        for (size_t i = 0; i < tabs[t]->table_size; i++) {                     \
+                                                                               \
+            if (IS_FULL(tabs[t]->ctrl[i])) {                                   \
+                                                                               \
+                /* Apply function to the key-value entry */                    \
+                struct tp##_entry data = tabs[t]->entries[i];                  \
+                int status = func(&data, param);                               \
+                                                                               \
+                if (status != HASHTABLE_OK)                                    \
+                    return status;                                             \
+                                                                               \
+            }                                                                  \
+        }                                                                      \
+    }                                                                          \
+                                                                               \
+    return HASHTABLE_OK;                                                       \
+}                                                                              \
+                                                                               \
+                                                                               \
+/*                                                                             \
+ * Deallocate the hashtable using the defined destructor, if the destructor is \
+ * NULL it call normal free on key-value pairs.                                \
+ */                                                                            \
+void fp##_release(Type *table) {                                               \
+                                                                               \
+    if (!table)                                                                \
+        return;                                                                \
+                                                                               \
+    fp##_map(table, table->destructor);                                        \
+                                                                               \
+    if (!table || !table->tab.entries)                                         \
+        return;                                                                \
+                                                                               \
+    tp##_free(&table->tab);                                                    \
+    tp##_free(&table->old);                                                    \
+    free(table);                                                               \
+}
 
-    hashtable_map(table, table->destructor);
 
-    if (!table || !table->entries)
-        return;
+HT_DEFINE(ht, hashtable, HashTable, const char *, HASH_STR, EQ_STR, FREE_KEY)
 
-    free(table->entries);
-    free(table);
-}
+HT_DEFINE(ht_u64, hashtable_u64, HashTableU64, uint64_t,
+          HASH_U64, EQ_VAL, KEEP_KEY)
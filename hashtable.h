@@ -40,12 +40,33 @@
 #define HASHTABLE_OOM  2
 #define HASHTABLE_FULL 3
 
+/* Slots probed at once, a control byte each */
+#define HT_GROUP_SIZE  16
 
-/* We need to keep keys and values */
+/*
+ * Elements moved to the new table by each operation during a resize, and
+ * slots visited at most for each of them
+ */
+#define HT_REHASH_STEP      4
+#define HT_REHASH_VISITS    8
+
+
+/*
+ * We need to keep keys and values, the hash of the key is cached so that
+ * probes compare it before the strings and rehashes never recompute it
+ */
 struct ht_entry {
     const char *key;
     void *val;
-    bool taken;
+    uint64_t hash;
+};
+
+
+/* Probe lengths of the elements, counting the home slot */
+struct ht_probe_stats {
+    size_t max;
+    double mean;
+    double load;
 };
 
 
@@ -56,14 +77,30 @@ typedef int ht_binary_fun(struct ht_entry *, void *);
 
 
 /*
- * An HashTable has some maximum size and current size, as well as the data to
- * hold.
+ * An array of slots, entries are paired with an array of control bytes,
+ * telling which slots are taken and filtering them by 7 bits of their hash.
+ * It runs at up to 7/8 load.
  */
-typedef struct {
+struct ht_table {
     size_t table_size;
     size_t size;
-    ht_unary_fun *destructor;
+    size_t max_probe;       /* Longest displacement from a home slot */
     struct ht_entry *entries;
+    unsigned char *ctrl;
+};
+
+
+/*
+ * An HashTable has some maximum size and current size, as well as the data to
+ * hold. Resizes are incremental: while one is in progress the elements not
+ * moved yet stay in the old table, and every operation moves a few of them.
+ */
+typedef struct {
+    uint64_t seed;
+    ht_unary_fun *destructor;
+    struct ht_table tab;
+    struct ht_table old;
+    size_t rehash_idx;      /* Next slot of the old table to move */
 } HashTable;
 
 
@@ -96,9 +133,22 @@ int hashtable_put(HashTable *, const char *, void *);
 /* Retrieve a value from the hashtable, accept a const char * as key. */
 void *hashtable_get(HashTable *, const char *);
 
+/* Return the key-value pair of a key, NULL if it's missing */
+struct ht_entry *hashtable_get_entry(HashTable *, const char *);
+
 /* Remove a key-value pair from the hashtable, accept a const char * as key. */
 int hashtable_del(HashTable *, const char *);
 
+/*
+ * Move up to n elements of an ongoing resize to the new table, so that the
+ * work can be done ahead of time, e.g. when idle. Return 1 if the resize is
+ * still in progress, 0 otherwise.
+ */
+int hashtable_rehash_step(HashTable *, size_t);
+
+/* Measure the probe lengths of the elements, with a full scan */
+void hashtable_probe_stats(const HashTable *, struct ht_probe_stats *);
+
 /*
  * Iterate through all key-value pairs in the hashtable, accept a functor as
  * parameter to apply function to each pair
@@ -111,5 +161,62 @@ int hashtable_map(HashTable *, ht_unary_fun *);
  */
 int hashtable_map2(HashTable *, ht_binary_fun *, void *);
 
+/* Seeded hash of a string, shared by the other tables keyed by strings */
+uint64_t hashtable_hash(const char *, uint64_t);
+
+/* Return a fresh seed for a table, mixing in its address */
+uint64_t hashtable_seed(const void *);
+
+
+/*
+ * Declare a HashTable specialized for another type of key, with the same API
+ * and semantics: tp prefixes the types, fp the functions. Keys are stored by
+ * value and never released, the default destructor only frees the value.
+ */
+#define HT_DECLARE(tp, fp, Type, key_t)                                        \
+                                                                               \
+struct tp##_entry {                                                            \
+    key_t key;                                                                 \
+    void *val;                                                                 \
+    uint64_t hash;                                                             \
+};                                                                             \
+                                                                               \
+typedef int tp##_unary_fun(struct tp##_entry *);                               \
+                                                                               \
+typedef int tp##_binary_fun(struct tp##_entry *, void *);                      \
+                                                                               \
+struct tp##_table {                                                            \
+    size_t table_size;                                                         \
+    size_t size;                                                               \
+    size_t max_probe;                                                          \
+    struct tp##_entry *entries;                                                \
+    unsigned char *ctrl;                                                       \
+};                                                                             \
+                                                                               \
+typedef struct {                                                               \
+    uint64_t seed;                                                             \
+    tp##_unary_fun *destructor;                                                \
+    struct tp##_table tab;                                                     \
+    struct tp##_table old;                                                     \
+    size_t rehash_idx;                                                         \
+} Type;                                                                        \
+                                                                               \
+Type *fp##_create(tp##_unary_fun *);                                           \
+void fp##_init(Type *, tp##_unary_fun *);                                      \
+void fp##_release(Type *);                                                     \
+size_t fp##_size(const Type *);                                                \
+int fp##_put(Type *, key_t, void *);                                           \
+void *fp##_get(Type *, key_t);                                                 \
+struct tp##_entry *fp##_get_entry(Type *, key_t);                              \
+int fp##_del(Type *, key_t);                                                   \
+int fp##_rehash_step(Type *, size_t);                                          \
+void fp##_probe_stats(const Type *, struct ht_probe_stats *);                  \
+int fp##_map(Type *, tp##_unary_fun *);                                        \
+int fp##_map2(Type *, tp##_binary_fun *, void *)
+
+
+/* Keyed by integers, like maps do with theirs, no strlen nor strcmp */
+HT_DECLARE(ht_u64, hashtable_u64, HashTableU64, uint64_t);
+
 
 #endif
@@ -0,0 +1,98 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "intern.h"
+
+
+static struct {
+    HashTable *ids;
+    char **names;
+    size_t size;
+    size_t capacity;
+} symtab;
+
+
+/* Names are owned by the names array and IDs aren't pointers */
+static int intern_entry_del(struct ht_entry *entry) {
+    (void) entry;
+    return HASHTABLE_OK;
+}
+
+
+unsigned intern(const char *name) {
+
+    if (!symtab.ids)
+        symtab.ids = hashtable_create(intern_entry_del);
+
+    /* IDs are stored shifted by one, NULL means not found */
+    void *id = hashtable_get(symtab.ids, name);
+    if (id)
+        return (unsigned) ((uintptr_t) id - 1);
+
+    if (symtab.size == symtab.capacity) {
+        symtab.capacity = symtab.capacity ? symtab.capacity * 2 : 64;
+        symtab.names = realloc(symtab.names,
+                               symtab.capacity * sizeof(*symtab.names));
+    }
+
+    char *key = malloc(strlen(name) + 1);
+    strcpy(key, name);
+
+    unsigned sym = symtab.size;
+    symtab.names[symtab.size++] = key;
+
+    hashtable_put(symtab.ids, key, (void *) ((uintptr_t) sym + 1));
+
+    return sym;
+}
+
+
+const char *intern_name(unsigned sym) {
+    assert(sym < symtab.size);
+    return symtab.names[sym];
+}
+
+
+size_t intern_size(void) {
+    return symtab.size;
+}
+
+
+void intern_probe_stats(struct ht_probe_stats *stats) {
+
+    if (!symtab.ids) {
+        *stats = (struct ht_probe_stats) {0};
+        return;
+    }
+
+    hashtable_probe_stats(symtab.ids, stats);
+}
@@ -28,13 +28,20 @@
 
 #include "runtime.h"
 #include "builtins.h"
+#include "vm.h"
+#include "bigint.h"
+#include "simd.h"
+#include "seq.h"
 
 #include <stdio.h>
-#include <strings.h>
 
 #define IS_SPACE(c)    (c == ' ' || c == '\n')
 
-#define STREQ(s1, s2)  (strncasecmp(s1, s2, strlen(s1)) == 0)
+/* Longer literals may not fit a long long, they're read as bigints */
+#define MAX_INT_DIGITS      18
+
+/* Bindings moved ahead of time while waiting for input, when resizing */
+#define IDLE_REHASH_STEP    1024
 
 
 static void expr_print(struct expr *);
@@ -48,40 +55,9 @@ struct runtime {
 static struct runtime runtime = { .ctx = &(Context) {0}};
 
 
+/* Builtins can't be rebound, calls to them are resolved at compile time */
 static void context_add_builtin(Context *ctx, char *name, fun *fn) {
-    struct expr *sym_exp = malloc(sizeof(*sym_exp));
-    expr_symbol(sym_exp, name);
-    struct expr *fun_exp = malloc(sizeof(*fun_exp));
-    expr_fun(fun_exp, fn);
-    context_put(ctx, sym_exp, fun_exp);
-}
-
-
-static struct expr *compute_op(struct expr *, char);
-
-
-static struct expr *builtin_add(Context *ctx, struct expr *exp) {
-    return compute_op(exp, '+');
-}
-
-
-static struct expr *builtin_sub(Context *ctx, struct expr *exp) {
-    return compute_op(exp, '-');
-}
-
-
-static struct expr *builtin_mul(Context *ctx, struct expr *exp) {
-    return compute_op(exp, '*');
-}
-
-
-static struct expr *builtin_div(Context *ctx, struct expr *exp) {
-    return compute_op(exp, '/');
-}
-
-
-static struct expr *builtin_mod(Context *ctx, struct expr *exp) {
-    return compute_op(exp, '%');
+    context_put_const(ctx, expr_new_symbol(name), expr_new_fun(fn));
 }
 
 
@@ -103,115 +79,102 @@ static void context_add_builtins(Context *ctx) {
     context_add_builtin(ctx, "last", builtin_last);
     context_add_builtin(ctx, "eval", builtin_eval);
     context_add_builtin(ctx, "list", builtin_list);
+    context_add_builtin(ctx, "lambda", builtin_lambda);
+    context_add_builtin(ctx, "if", builtin_if);
+
+    /* Hash maps */
+    context_add_builtin(ctx, "map", builtin_map);
+    context_add_builtin(ctx, "map-get", builtin_map_get);
+    context_add_builtin(ctx, "map-put", builtin_map_put);
+    context_add_builtin(ctx, "map-del", builtin_map_del);
+    context_add_builtin(ctx, "map-keys", builtin_map_keys);
+    context_add_builtin(ctx, "map-size", builtin_map_size);
+
+    /* Unboxed numeric vectors */
+    context_add_builtin(ctx, "vector", builtin_vector);
+    context_add_builtin(ctx, "vector-list", builtin_vector_list);
+    context_add_builtin(ctx, "vector-sum", builtin_vector_sum);
+    context_add_builtin(ctx, "vector-dot", builtin_vector_dot);
+    context_add_builtin(ctx, "vector-min", builtin_vector_min);
+    context_add_builtin(ctx, "vector-max", builtin_vector_max);
+    context_add_builtin(ctx, "vector-add", builtin_vector_add);
+    context_add_builtin(ctx, "vector-mul", builtin_vector_mul);
+    context_add_builtin(ctx, "vector-scale", builtin_vector_scale);
+
+    /* Lazy sequences */
+    context_add_builtin(ctx, "range", builtin_range);
+    context_add_builtin(ctx, "lmap", builtin_lmap);
+    context_add_builtin(ctx, "lfilter", builtin_lfilter);
+    context_add_builtin(ctx, "take", builtin_take);
+    context_add_builtin(ctx, "reduce", builtin_reduce);
 
     return;
 }
 
 
-static struct expr *compute_op(struct expr *exp, char operator) {
-
-    for (int i = 0; i < exp->count; i++) {
-        if (exp->children[i]
-            && exp->children[i]->etype != INTEGER
-            && exp->children[i]->etype != DECIMAL
-            && exp->children[i]->etype != ERROR
-            && exp->children[i]->etype != SEXP_END) {
-            expr_del(exp);
-            return NULL;
-        }
-    }
-
-    struct expr *x = expr_pop(exp, 0);
-
-    if (operator == '-' && exp->count == 2)
-        x->integer = -x->integer;
-
-    while (exp->count > 0) {
-
-        struct expr *y = expr_pop(exp, 0);
-
-        if (!y || y->etype == SEXP_END)
-            continue;
-
-        if (x->etype == DECIMAL || y->etype == DECIMAL)
-            x = builtin_decimal_op(x, operator,
-                                   x->etype == DECIMAL ?
-                                   x->decimal : x->integer,
-                                   y->etype == DECIMAL ?
-                                   y->decimal : y->integer);
-        else
-            x = builtin_integer_op(x, operator, x->integer, y->integer);
-
-        if (x->etype == ERROR)
-            return x;
-
-        if (y->etype == ERROR)
-            return y;
-
-        expr_del(y);
-    }
-
-    expr_del(exp);
-
-    return x;
-}
-
-
-static struct expr *expr_eval(Context *ctx, struct expr *exp) {
-
-    for (int i = 0; i < exp->count; i++)
-        exp->children[i] = eval(ctx, exp->children[i]);
-
-    for (int i = 0; i < exp->count; i++)
-        if (exp->children[i] && exp->children[i]->etype == ERROR)
-            return expr_take(exp, i);
-
-    if (exp->count == 0)
-        return exp;
-
-    if (exp->count == 1)
-        return expr_take(exp, 0);
-
-    struct expr *sxp = expr_pop(exp, 0);
-
-    if (sxp->etype != FUNCTION) {
-        expr_del(sxp);
-        expr_err(exp, "Not a function");
-        return exp;
-    }
-
-    struct expr *result = sxp->fn(ctx, exp);
-    expr_del(sxp);
-
-    return result;
-}
-
-
+/*
+ * S-expressions are compiled and run on the VM, symbols are looked up in the
+ * context and anything else evaluates to itself.
+ */
 struct expr *eval(Context *ctx, struct expr *exp) {
 
-    if (exp && exp->etype == SYMBOL)
+    if (exp && expr_type(exp) == SYMBOL)
         return context_get(ctx, exp);
 
-    if (exp && exp->etype == SEXP)
-        return expr_eval(ctx, exp);
+    if (exp && expr_type(exp) == SEXP)
+        return vm_eval(ctx, exp);
 
     return exp;
 }
 
 
+/* Counters of the runtime, shown by the :stats command */
+static void print_stats(void) {
+
+    struct vm_stats vs;
+    struct gc_stats gs;
+    struct ht_probe_stats ps;
+    struct arena_stats as;
+
+    vm_stats(&vs);
+    gc_stats(&gs);
+    intern_probe_stats(&ps);
+    expr_arena_stats(&as);
+
+    printf("compiled %zu, folded %zu, resolved %zu\n",
+           vs.compiled, vs.folded, vs.resolved);
+    printf("loads hit %zu, missed %zu\n", vs.load_hits, vs.load_misses);
+    printf("collections %zu, live %zu, heap %zu bytes\n",
+           gs.collections, gs.live, gs.heap_size);
+    printf("arena hits %zu, misses %zu, slabs %zu, big blocks %zu\n",
+           as.hits, as.misses, as.slabs, as.bigs);
+    printf("symbols %zu, load %.2f, probes max %zu mean %.2f\n",
+           intern_size(), ps.load, ps.max, ps.mean);
+    printf("simd kernels %s\n", simd_kernels());
+}
+
+
 static inline void banner(void) {
     printf("\nStart zlisp REPL v%s\n", ZLISP_VERSION);
-    printf("Press Ctrl+c to exit\n\n");
+    printf("Press Ctrl+c to exit, :stats to show runtime counters\n\n");
     printf("zlisp> ");
 }
 
 
+static int map_print_entry(struct expr *key, struct expr *val, void *arg) {
+    (void) arg;
+    expr_print(key);
+    expr_print(val);
+    return HASHTABLE_OK;
+}
+
+
 static void expr_print(struct expr *exp) {
 
     if (!exp)
         return;
 
-    switch (exp->etype) {
+    switch (expr_type(exp)) {
         case SEXP:
             printf("(");
             for (int i = 0; i < exp->count; i++)
@@ -224,13 +187,23 @@ static void expr_print(struct expr *exp) {
                 expr_print(exp->children[i]);
             break;
         case INTEGER:
-            printf("%lld ", exp->integer);
+            printf("%lld ", expr_ival(exp));
             break;
+        case BIGINT: {
+            struct bigint b;
+            bigint_init(&b);
+            expr_get_bigint(exp, &b);
+            char *digits = bigint_to_string(&b);
+            printf("%s ", digits);
+            free(digits);
+            bigint_free(&b);
+            break;
+        }
         case DECIMAL:
             printf("%lf ", exp->decimal);
             break;
         case SYMBOL:
-            printf("%s ", exp->symbol);
+            printf("%s ", intern_name(exp->symbol));
             break;
         case STRING:
             printf("\"%s\" ", exp->string);
@@ -238,6 +211,39 @@ static void expr_print(struct expr *exp) {
         case ERROR:
             printf("Error: %s", exp->err);
             break;
+        case LAMBDA:
+            printf("(lambda ");
+            expr_print(LAMBDA_PROTO(exp)->formals);
+            expr_print(LAMBDA_PROTO(exp)->body);
+            printf(") ");
+            break;
+        case MAP:
+            printf("{");
+            expr_map_each(exp, map_print_entry, NULL);
+            printf("} ");
+            break;
+        case VECTOR:
+            printf("[");
+            for (int i = 0; i < exp->count; i++) {
+                if (VECTOR(exp)->decimal)
+                    printf("%lf ", VECTOR(exp)->reals[i]);
+                else
+                    printf("%lld ", (long long) VECTOR(exp)->ints[i]);
+            }
+            printf("] ");
+            break;
+        case SEQ: {
+            /* Sequences are realized as they're printed, one at a time */
+            struct seq_iter it;
+            struct expr *x;
+            printf("'");
+            seq_iter_init(&it, runtime.ctx, exp);
+            while ((x = seq_iter_next(&it)) && expr_type(x) != ERROR)
+                expr_print(x);
+            expr_print(x);
+            seq_iter_release(&it);
+            break;
+        }
         case SEXP_END:
             break;
         default:
@@ -246,55 +252,75 @@ static void expr_print(struct expr *exp) {
 }
 
 
+/* Numbers don't need a node unless they're decimals or really big */
+static struct expr *parse_number(char **buf) {
+
+    char *start = *buf;
+    bool decimal = false;
+
+    while (('0' <= **buf && **buf <= '9') || **buf == '.') {
+        if (**buf == '.')
+            decimal = true;
+        (*buf)++;
+    }
+
+    /* Digits are read in place, as the names of symbols */
+    char end = **buf;
+    **buf = '\0';
+
+    struct expr *exp;
+
+    if (decimal) {
+        exp = expr_new_decimal(strtod(start, NULL));
+    } else if (*buf - start <= MAX_INT_DIGITS) {
+        exp = expr_new_integer(strtoll(start, NULL, 10));
+    } else {
+        struct bigint b;
+        bigint_init(&b);
+        bigint_from_string(&b, start);
+        exp = expr_new_bigint(&b);
+        bigint_free(&b);
+    }
+
+    **buf = end;
+
+    return exp;
+}
+
+
 static struct expr *parse_expr(char **buf, bool is_qexp) {
 
     while (**buf && IS_SPACE(**buf)) (*buf)++;
 
-    if (!**buf) {
-        struct expr *exp = malloc(sizeof(*exp));
-        expr_end(exp);
-        return exp;
-    }
+    if (!**buf)
+        return expr_new_end();
 
-    struct expr *exp = malloc(sizeof(*exp));
+    if ('0' <= **buf && **buf <= '9')
+        return parse_number(buf);
+
+    struct expr *exp = NULL;
 
     if (**buf == '(' || **buf == '\'') {
-        expr_sexp(exp);
         if (**buf == '\'') {
             is_qexp = true;
-            exp->etype = QEXP;
+            exp = expr_new_qexp();
+        } else {
+            exp = expr_new_sexp();
         }
         (*buf)++;
-        while (**buf && **buf != ')')
+        while (**buf && **buf != ')') {
             exp = expr_append(exp, parse_expr(buf, is_qexp));
-        (*buf)++;
+            while (**buf && IS_SPACE(**buf)) (*buf)++;
+        }
+        if (**buf)
+            (*buf)++;
     } else if (**buf == ')') {
-        expr_end(exp);
+        exp = expr_new_end();
         (*buf)++;
     } else if (**buf == '+' || **buf == '-' || **buf == '*'
                || **buf == '/' || **buf == '%') {
-        expr_operator(exp, **buf);
+        exp = expr_new_operator(**buf);
         (*buf)++;
-    } else if ('0' <= **buf && **buf <= '9') {
-        char tmp[MAX_ERR_SIZE];
-        int decimal = 0;
-        int i = 0;
-        tmp[i++] = **buf;
-        (*buf)++;
-        while (**buf && (('0' <= **buf && **buf <= '9') || **buf == '.')) {
-            if (**buf == '.')
-                decimal = 1;
-            tmp[i++] = **buf;
-            (*buf)++;
-        }
-        tmp[i] = '\0';
-
-        long long n;
-        double d;
-        if (decimal == 0 && sscanf(tmp, "%lld", &n))
-            expr_integer(exp, n);
-        else if (sscanf(tmp, "%lf", &d))
-            expr_decimal(exp, d);
     } else if (**buf == '"') {
         int base_size = MAX_SYM_SIZE;
         char *str = malloc(base_size * sizeof(char));
@@ -311,52 +337,21 @@ static struct expr *parse_expr(char **buf, bool is_qexp) {
         }
         str[i] = '\0';
         (*buf)++;
-        expr_string(exp, str);
-
-    } else {
+        exp = expr_new_string(str);
+        free(str);
 
-        if (STREQ("head", *buf)) {
-            expr_symbol(exp, "head");
-            (*buf) += 4;
-        } else if (STREQ("len", *buf)) {
-            expr_symbol(exp, "len");
-            (*buf) += 3;
-        } else if (STREQ("last", *buf)) {
-            expr_symbol(exp, "last");
-            (*buf) += 4;
-        } else if (STREQ("init", *buf)) {
-            expr_symbol(exp, "init");
-            (*buf) += 4;
-        } else if (STREQ("eval", *buf)) {
-            expr_symbol(exp, "eval");
-            (*buf) += 4;
-        } else if (STREQ("tail", *buf)) {
-            expr_symbol(exp, "tail");
-            (*buf) += 4;
-        } else if (STREQ("list", *buf)) {
-            expr_symbol(exp, "list");
-            (*buf) += 4;
-        } else if (STREQ("def", *buf)) {
-            expr_symbol(exp, "def");
-            (*buf) += 3;
-        } else {
-            if (is_qexp) {
-                char tmp[MAX_SYM_SIZE];
-                int i = 0;
-                for (i = 0; i < MAX_SYM_SIZE; i++) {
-                    if (IS_SPACE(**buf))
-                        break;
-                    tmp[i] = *((*buf)++);
-                }
-                tmp[i] = '\0';
-                expr_symbol(exp, tmp);
-                /* (*buf) += i; */
-            } else {
-                expr_err(exp, "Unknown token");
-                /* (*buf)++; */
-            }
+    } else if (is_qexp) {
+        /* Symbols are interned, the name is only needed once, here */
+        char *start = *buf;
+        while (**buf && !IS_SPACE(**buf) && **buf != '(' && **buf != ')')
             (*buf)++;
-        }
+        char end = **buf;
+        **buf = '\0';
+        exp = expr_new_symbol(start);
+        **buf = end;
+    } else {
+        exp = expr_new_err("Unknown token");
+        (*buf)++;
     }
 
     return exp;
@@ -365,8 +360,7 @@ static struct expr *parse_expr(char **buf, bool is_qexp) {
 
 static struct expr *parse(char *buf) {
 
-    struct expr *exp = malloc(sizeof(*exp));
-    expr_sexp(exp);
+    struct expr *exp = expr_new_sexp();
 
     if (*buf == '(') {
         buf++;
@@ -390,6 +384,9 @@ int main(void) {
 
     context_init(runtime.ctx);
     context_add_builtins(runtime.ctx);
+    context_freeze(runtime.ctx);
+    vm_init();
+    simd_init();
 
     while (fgets(buf, 256, stdin)) {
 
@@ -398,21 +395,37 @@ int main(void) {
             continue;
         }
 
+        if (strncmp(buf, ":stats", 6) == 0) {
+            print_stats();
+            printf("\nzlisp> ");
+            continue;
+        }
+
         struct expr *exp = parse(buf);
 
+        /* Printing a sequence runs it, and may collect */
+        gc_push_root(exp);
+
         expr_print(exp);
         printf("\n");
 
-        if (expr_peek(exp, 0)->etype != SYMBOL) {
+        if (expr_type(expr_peek(exp, 0)) != SYMBOL) {
             expr_print(exp);
         } else {
             struct expr *sxp = eval(runtime.ctx, exp);
 
+            gc_push_root(sxp);
             expr_print(sxp);
-
-            expr_del(sxp);
+            gc_pop_root();
         }
 
+        gc_pop_root();
+
+        /* Nothing but the context survives a round of evaluation */
+        gc_maybe_collect();
+
+        context_rehash_step(runtime.ctx, IDLE_REHASH_STEP);
+
         printf("\nzlisp> ");
 
         memset(buf, 0x00, 256);
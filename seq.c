@@ -0,0 +1,143 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "seq.h"
+#include "vm.h"
+
+#include <stdlib.h>
+
+
+/* Elements left in a range, its end is excluded */
+static unsigned long long seq_range_size(long long start, long long end,
+                                         long long step) {
+
+    /* Differences are taken as unsigned, they may not fit a long long */
+    if (step > 0 && start < end)
+        return ((unsigned long long) end - start - 1) / step + 1;
+
+    if (step < 0 && start > end)
+        return ((unsigned long long) start - end - 1) / (0ULL - step) + 1;
+
+    return 0;
+}
+
+
+void seq_iter_init(struct seq_iter *it, Context *ctx, struct expr *seq) {
+
+    struct expr *src = seq;
+
+    *it = (struct seq_iter) { .ctx = ctx };
+
+    gc_push_root(seq);
+
+    while (expr_type(src) == SEQ && SEQ_KIND(src) != SEQ_RANGE) {
+        src = SEQ_SOURCE(src);
+        it->nstages++;
+    }
+
+    if (it->nstages > 0)
+        it->stages = malloc(it->nstages * sizeof(*it->stages));
+
+    /* Stages are chained from the outermost one, they run from the source */
+    int i = it->nstages;
+    for (struct expr *s = seq; s != src; s = SEQ_SOURCE(s)) {
+        struct seq_stage *stage = &it->stages[--i];
+        stage->kind = SEQ_KIND(s);
+        stage->fn = SEQ_ARG(s);
+        stage->left = stage->kind == SEQ_TAKE ? expr_ival(SEQ_ARG(s)) : 0;
+    }
+
+    if (expr_type(src) != SEQ) {
+        it->items = src;
+        return;
+    }
+
+    it->next = expr_ival(src->children[1]);
+    it->step = expr_ival(src->children[3]);
+    it->left = seq_range_size(it->next, expr_ival(src->children[2]),
+                              it->step);
+}
+
+
+struct expr *seq_iter_next(struct seq_iter *it) {
+
+    struct expr *x;
+
+pull:
+
+    /* Nothing gets past an exhausted take, the source isn't even pulled */
+    for (int i = 0; i < it->nstages; i++)
+        if (it->stages[i].kind == SEQ_TAKE && it->stages[i].left == 0)
+            return NULL;
+
+    gc_maybe_collect();
+
+    if (it->items) {
+        if (it->index == expr_arg_count(it->items))
+            return NULL;
+        x = it->items->children[it->index++];
+    } else {
+        if (it->left == 0)
+            return NULL;
+        x = expr_new_integer(it->next);
+        it->next = (long long) ((unsigned long long) it->next + it->step);
+        it->left--;
+    }
+
+    for (int i = 0; i < it->nstages; i++) {
+        struct seq_stage *stage = &it->stages[i];
+        struct expr *keep;
+        switch (stage->kind) {
+            case SEQ_MAP:
+                x = vm_funcall(it->ctx, stage->fn, &x, 1);
+                break;
+            case SEQ_FILTER:
+                keep = vm_funcall(it->ctx, stage->fn, &x, 1);
+                if (keep && expr_type(keep) == ERROR)
+                    return keep;
+                if (!keep || !expr_truthy(keep))
+                    goto pull;
+                break;
+            case SEQ_TAKE:
+                stage->left--;
+                break;
+            default:
+                break;
+        }
+        if (x && expr_type(x) == ERROR)
+            return x;
+    }
+
+    return x;
+}
+
+
+void seq_iter_release(struct seq_iter *it) {
+    free(it->stages);
+    gc_pop_root();
+}
@@ -0,0 +1,72 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEQ_H
+#define SEQ_H
+
+#include "core.h"
+
+
+/*
+ * Cursor over a lazy sequence. The stages of the pipeline are flattened once,
+ * from the source outwards, then every element is pulled through all of them
+ * before the next one is produced: no intermediate list is ever built and the
+ * memory in use doesn't depend on the length of the sequence.
+ *
+ * Functions of the stages run on the VM, a collection may start on every
+ * pull. The sequence is rooted until the cursor is released, anything else
+ * the caller holds on to across pulls must be rooted by the caller.
+ */
+struct seq_stage {
+    seqkind kind;
+    struct expr *fn;
+    long long left;
+};
+
+struct seq_iter {
+    Context *ctx;
+    struct expr *items;
+    int index;
+    long long next;
+    long long step;
+    unsigned long long left;
+    int nstages;
+    struct seq_stage *stages;
+};
+
+
+/* Lists are sources as well, their items are pulled in order */
+void seq_iter_init(struct seq_iter *, Context *, struct expr *);
+
+/* Next element, NULL at the end or the first ERROR met along the stages */
+struct expr *seq_iter_next(struct seq_iter *);
+
+void seq_iter_release(struct seq_iter *);
+
+
+#endif
@@ -0,0 +1,652 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "simd.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* AVX2 kernels are always built on x86, they're run only if supported */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SIMD_AVX2
+#define AVX2_TARGET         __attribute__((target("avx2")))
+#endif
+
+/* Bodies shared by the kernels of every target, compiled once for each */
+#ifdef __GNUC__
+#define SIMD_INLINE         static inline __attribute__((always_inline))
+#else
+#define SIMD_INLINE         static inline
+#endif
+
+
+struct simd_kernels {
+    const char *name;
+    bool (*sum_ints)(const int64_t *, size_t, int64_t *);
+    double (*sum_reals)(const double *, size_t);
+    double (*dot_reals)(const double *, const double *, size_t);
+    int64_t (*min_ints)(const int64_t *, size_t);
+    int64_t (*max_ints)(const int64_t *, size_t);
+    double (*min_reals)(const double *, size_t);
+    double (*max_reals)(const double *, size_t);
+    bool (*add_ints)(int64_t *, const int64_t *, const int64_t *, size_t);
+    void (*add_reals)(double *, const double *, const double *, size_t);
+    void (*mul_reals)(double *, const double *, const double *, size_t);
+    void (*scale_reals)(double *, const double *, double, size_t);
+};
+
+
+/*
+ * Integers are summed exactly whatever their count: the unsigned 32 bits
+ * halves are accumulated apart, along with the count of negative numbers.
+ * Here the signed total is put back together, true is returned if it
+ * doesn't fit an int64_t. fixnum_sum in builtins.c sums tagged words here.
+ */
+static bool sum_ints_finish(uint64_t lo, uint64_t hi, uint64_t neg,
+                            int64_t *sum) {
+
+    /* The total is hi * 2^32 + lo - neg * 2^64, on two words */
+    uint64_t tlo = hi << 32;
+    uint64_t thi = (hi >> 32) - neg;
+
+    tlo += lo;
+    thi += tlo < lo;
+
+    *sum = (int64_t) tlo;
+
+    return thi != (*sum < 0 ? UINT64_MAX : 0);
+}
+
+
+SIMD_INLINE bool add_ints(int64_t *restrict r, const int64_t *restrict a,
+                          const int64_t *restrict b, size_t n) {
+
+    uint64_t over = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t x = a[i], y = b[i], s = x + y;
+        /* Operands of the same sign and a result of the other one */
+        over |= (x ^ s) & (y ^ s);
+        r[i] = (int64_t) s;
+    }
+
+    return over >> 63;
+}
+
+
+SIMD_INLINE void add_reals(double *restrict r, const double *restrict a,
+                           const double *restrict b, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        r[i] = a[i] + b[i];
+}
+
+
+SIMD_INLINE void mul_reals(double *restrict r, const double *restrict a,
+                           const double *restrict b, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        r[i] = a[i] * b[i];
+}
+
+
+SIMD_INLINE void scale_reals(double *restrict r, const double *restrict a,
+                             double k, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        r[i] = a[i] * k;
+}
+
+
+/* Baseline kernels, SSE2 on x86 and plain C anywhere else */
+static bool sum_ints_base(const int64_t *a, size_t n, int64_t *sum) {
+
+    uint64_t lo = 0, hi = 0, neg = 0;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i mask = _mm_set1_epi64x(0xFFFFFFFF);
+    __m128i vlo = _mm_setzero_si128();
+    __m128i vhi = _mm_setzero_si128();
+    __m128i vneg = _mm_setzero_si128();
+    uint64_t lanes[2];
+
+    for (; i + 2 <= n; i += 2) {
+        __m128i w = _mm_loadu_si128((const __m128i *) (a + i));
+        vlo = _mm_add_epi64(vlo, _mm_and_si128(w, mask));
+        vhi = _mm_add_epi64(vhi, _mm_srli_epi64(w, 32));
+        vneg = _mm_add_epi64(vneg, _mm_srli_epi64(w, 63));
+    }
+
+    _mm_storeu_si128((__m128i *) lanes, vlo);
+    lo = lanes[0] + lanes[1];
+    _mm_storeu_si128((__m128i *) lanes, vhi);
+    hi = lanes[0] + lanes[1];
+    _mm_storeu_si128((__m128i *) lanes, vneg);
+    neg = lanes[0] + lanes[1];
+#endif
+
+    for (; i < n; i++) {
+        uint64_t w = (uint64_t) a[i];
+        lo += w & 0xFFFFFFFF;
+        hi += w >> 32;
+        neg += w >> 63;
+    }
+
+    return sum_ints_finish(lo, hi, neg, sum);
+}
+
+
+static double sum_reals_base(const double *a, size_t n) {
+
+    double sum = 0.0;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    double lanes[2];
+
+    for (; i + 4 <= n; i += 4) {
+        s0 = _mm_add_pd(s0, _mm_loadu_pd(a + i));
+        s1 = _mm_add_pd(s1, _mm_loadu_pd(a + i + 2));
+    }
+
+    _mm_storeu_pd(lanes, _mm_add_pd(s0, s1));
+    sum = lanes[0] + lanes[1];
+#endif
+
+    for (; i < n; i++)
+        sum += a[i];
+
+    return sum;
+}
+
+
+static double dot_reals_base(const double *a, const double *b, size_t n) {
+
+    double dot = 0.0;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    double lanes[2];
+
+    for (; i + 4 <= n; i += 4) {
+        s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a + i),
+                                       _mm_loadu_pd(b + i)));
+        s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(a + i + 2),
+                                       _mm_loadu_pd(b + i + 2)));
+    }
+
+    _mm_storeu_pd(lanes, _mm_add_pd(s0, s1));
+    dot = lanes[0] + lanes[1];
+#endif
+
+    for (; i < n; i++)
+        dot += a[i] * b[i];
+
+    return dot;
+}
+
+
+/* Comparisons need SSE4.2 for 64 bits lanes, the baseline stays scalar */
+SIMD_INLINE int64_t extreme_ints_base(const int64_t *a, size_t n, bool max) {
+
+    int64_t m = a[0];
+
+    for (size_t i = 1; i < n; i++)
+        if (max ? a[i] > m : a[i] < m)
+            m = a[i];
+
+    return m;
+}
+
+
+/*
+ * A NaN anywhere makes the extreme of decimals a NaN, whatever the kernel:
+ * min and max instructions pick an operand when the comparison fails, so
+ * unordered lanes are tracked apart and checked at the end.
+ */
+SIMD_INLINE double extreme_reals_base(const double *a, size_t n, bool max) {
+
+    double m = a[0];
+    bool unordered = isnan(m);
+    size_t i = 1;
+
+#ifdef __SSE2__
+    if (n >= 4) {
+        __m128d m0 = _mm_loadu_pd(a), m1 = _mm_loadu_pd(a + 2);
+        __m128d un = _mm_cmpunord_pd(m0, m1);
+        double lanes[2];
+        for (i = 4; i + 4 <= n; i += 4) {
+            __m128d x0 = _mm_loadu_pd(a + i), x1 = _mm_loadu_pd(a + i + 2);
+            un = _mm_or_pd(un, _mm_cmpunord_pd(x0, x1));
+            m0 = max ? _mm_max_pd(m0, x0) : _mm_min_pd(m0, x0);
+            m1 = max ? _mm_max_pd(m1, x1) : _mm_min_pd(m1, x1);
+        }
+        _mm_storeu_pd(lanes, max ? _mm_max_pd(m0, m1) : _mm_min_pd(m0, m1));
+        unordered = _mm_movemask_pd(un) != 0;
+        m = lanes[0];
+        if (max ? lanes[1] > m : lanes[1] < m)
+            m = lanes[1];
+    }
+#endif
+
+    for (; i < n; i++) {
+        unordered |= isnan(a[i]);
+        if (max ? a[i] > m : a[i] < m)
+            m = a[i];
+    }
+
+    return unordered ? NAN : m;
+}
+
+
+static int64_t min_ints_base(const int64_t *a, size_t n) {
+    return extreme_ints_base(a, n, false);
+}
+
+
+static int64_t max_ints_base(const int64_t *a, size_t n) {
+    return extreme_ints_base(a, n, true);
+}
+
+
+static double min_reals_base(const double *a, size_t n) {
+    return extreme_reals_base(a, n, false);
+}
+
+
+static double max_reals_base(const double *a, size_t n) {
+    return extreme_reals_base(a, n, true);
+}
+
+
+static bool add_ints_base(int64_t *r, const int64_t *a,
+                          const int64_t *b, size_t n) {
+    return add_ints(r, a, b, n);
+}
+
+
+static void add_reals_base(double *r, const double *a,
+                           const double *b, size_t n) {
+    add_reals(r, a, b, n);
+}
+
+
+static void mul_reals_base(double *r, const double *a,
+                           const double *b, size_t n) {
+    mul_reals(r, a, b, n);
+}
+
+
+static void scale_reals_base(double *r, const double *a, double k, size_t n) {
+    scale_reals(r, a, k, n);
+}
+
+
+static const struct simd_kernels base_kernels = {
+#ifdef __SSE2__
+    .name = "sse2",
+#else
+    .name = "scalar",
+#endif
+    .sum_ints = sum_ints_base,
+    .sum_reals = sum_reals_base,
+    .dot_reals = dot_reals_base,
+    .min_ints = min_ints_base,
+    .max_ints = max_ints_base,
+    .min_reals = min_reals_base,
+    .max_reals = max_reals_base,
+    .add_ints = add_ints_base,
+    .add_reals = add_reals_base,
+    .mul_reals = mul_reals_base,
+    .scale_reals = scale_reals_base
+};
+
+
+#ifdef SIMD_AVX2
+
+/*
+ * AVX2 kernels, reductions keep two or four registers of partial results so
+ * that the latency of the additions doesn't bound the loop
+ */
+AVX2_TARGET
+static bool sum_ints_avx2(const int64_t *a, size_t n, int64_t *sum) {
+
+    const __m256i mask = _mm256_set1_epi64x(0xFFFFFFFF);
+    __m256i vlo = _mm256_setzero_si256();
+    __m256i vhi = _mm256_setzero_si256();
+    __m256i vneg = _mm256_setzero_si256();
+    uint64_t lo = 0, hi = 0, neg = 0;
+    uint64_t lanes[4];
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m256i w = _mm256_loadu_si256((const __m256i *) (a + i));
+        vlo = _mm256_add_epi64(vlo, _mm256_and_si256(w, mask));
+        vhi = _mm256_add_epi64(vhi, _mm256_srli_epi64(w, 32));
+        vneg = _mm256_add_epi64(vneg, _mm256_srli_epi64(w, 63));
+    }
+
+    _mm256_storeu_si256((__m256i *) lanes, vlo);
+    lo = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_si256((__m256i *) lanes, vhi);
+    hi = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_si256((__m256i *) lanes, vneg);
+    neg = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+    for (; i < n; i++) {
+        uint64_t w = (uint64_t) a[i];
+        lo += w & 0xFFFFFFFF;
+        hi += w >> 32;
+        neg += w >> 63;
+    }
+
+    return sum_ints_finish(lo, hi, neg, sum);
+}
+
+
+AVX2_TARGET
+static double sum_reals_avx2(const double *a, size_t n) {
+
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    __m256d s2 = _mm256_setzero_pd(), s3 = _mm256_setzero_pd();
+    double lanes[4];
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+        s1 = _mm256_add_pd(s1, _mm256_loadu_pd(a + i + 4));
+        s2 = _mm256_add_pd(s2, _mm256_loadu_pd(a + i + 8));
+        s3 = _mm256_add_pd(s3, _mm256_loadu_pd(a + i + 12));
+    }
+
+    _mm256_storeu_pd(lanes, _mm256_add_pd(_mm256_add_pd(s0, s1),
+                                          _mm256_add_pd(s2, s3)));
+    double sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+    for (; i < n; i++)
+        sum += a[i];
+
+    return sum;
+}
+
+
+AVX2_TARGET
+static double dot_reals_avx2(const double *a, const double *b, size_t n) {
+
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    __m256d s2 = _mm256_setzero_pd(), s3 = _mm256_setzero_pd();
+    double lanes[4];
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                             _mm256_loadu_pd(b + i)));
+        s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4),
+                                             _mm256_loadu_pd(b + i + 4)));
+        s2 = _mm256_add_pd(s2, _mm256_mul_pd(_mm256_loadu_pd(a + i + 8),
+                                             _mm256_loadu_pd(b + i + 8)));
+        s3 = _mm256_add_pd(s3, _mm256_mul_pd(_mm256_loadu_pd(a + i + 12),
+                                             _mm256_loadu_pd(b + i + 12)));
+    }
+
+    _mm256_storeu_pd(lanes, _mm256_add_pd(_mm256_add_pd(s0, s1),
+                                          _mm256_add_pd(s2, s3)));
+    double dot = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+    for (; i < n; i++)
+        dot += a[i] * b[i];
+
+    return dot;
+}
+
+
+AVX2_TARGET
+SIMD_INLINE int64_t extreme_ints_avx2(const int64_t *a, size_t n, bool max) {
+
+    int64_t m = a[0];
+    size_t i = 1;
+
+    if (n >= 8) {
+        __m256i m0 = _mm256_loadu_si256((const __m256i *) a);
+        __m256i m1 = _mm256_loadu_si256((const __m256i *) (a + 4));
+        int64_t lanes[4];
+        for (i = 8; i + 8 <= n; i += 8) {
+            __m256i x0 = _mm256_loadu_si256((const __m256i *) (a + i));
+            __m256i x1 = _mm256_loadu_si256((const __m256i *) (a + i + 4));
+            /* Keep the old lane where the new one doesn't win */
+            __m256i g0 = max ? _mm256_cmpgt_epi64(x0, m0)
+                : _mm256_cmpgt_epi64(m0, x0);
+            __m256i g1 = max ? _mm256_cmpgt_epi64(x1, m1)
+                : _mm256_cmpgt_epi64(m1, x1);
+            m0 = _mm256_blendv_epi8(m0, x0, g0);
+            m1 = _mm256_blendv_epi8(m1, x1, g1);
+        }
+        __m256i g = max ? _mm256_cmpgt_epi64(m1, m0)
+            : _mm256_cmpgt_epi64(m0, m1);
+        _mm256_storeu_si256((__m256i *) lanes, _mm256_blendv_epi8(m0, m1, g));
+        m = lanes[0];
+        for (int k = 1; k < 4; k++)
+            if (max ? lanes[k] > m : lanes[k] < m)
+                m = lanes[k];
+    }
+
+    for (; i < n; i++)
+        if (max ? a[i] > m : a[i] < m)
+            m = a[i];
+
+    return m;
+}
+
+
+AVX2_TARGET
+SIMD_INLINE double extreme_reals_avx2(const double *a, size_t n, bool max) {
+
+    double m = a[0];
+    bool unordered = isnan(m);
+    size_t i = 1;
+
+    if (n >= 8) {
+        __m256d m0 = _mm256_loadu_pd(a), m1 = _mm256_loadu_pd(a + 4);
+        __m256d un = _mm256_cmp_pd(m0, m1, _CMP_UNORD_Q);
+        double lanes[4];
+        for (i = 8; i + 8 <= n; i += 8) {
+            __m256d x0 = _mm256_loadu_pd(a + i);
+            __m256d x1 = _mm256_loadu_pd(a + i + 4);
+            un = _mm256_or_pd(un, _mm256_cmp_pd(x0, x1, _CMP_UNORD_Q));
+            m0 = max ? _mm256_max_pd(m0, x0) : _mm256_min_pd(m0, x0);
+            m1 = max ? _mm256_max_pd(m1, x1) : _mm256_min_pd(m1, x1);
+        }
+        _mm256_storeu_pd(lanes, max ? _mm256_max_pd(m0, m1)
+                         : _mm256_min_pd(m0, m1));
+        unordered = _mm256_movemask_pd(un) != 0;
+        m = lanes[0];
+        for (int k = 1; k < 4; k++)
+            if (max ? lanes[k] > m : lanes[k] < m)
+                m = lanes[k];
+    }
+
+    for (; i < n; i++) {
+        unordered |= isnan(a[i]);
+        if (max ? a[i] > m : a[i] < m)
+            m = a[i];
+    }
+
+    return unordered ? NAN : m;
+}
+
+
+AVX2_TARGET
+static int64_t min_ints_avx2(const int64_t *a, size_t n) {
+    return extreme_ints_avx2(a, n, false);
+}
+
+
+AVX2_TARGET
+static int64_t max_ints_avx2(const int64_t *a, size_t n) {
+    return extreme_ints_avx2(a, n, true);
+}
+
+
+AVX2_TARGET
+static double min_reals_avx2(const double *a, size_t n) {
+    return extreme_reals_avx2(a, n, false);
+}
+
+
+AVX2_TARGET
+static double max_reals_avx2(const double *a, size_t n) {
+    return extreme_reals_avx2(a, n, true);
+}
+
+
+/* Element-wise kernels are the shared loops, vectorized for AVX2 */
+AVX2_TARGET
+static bool add_ints_avx2(int64_t *r, const int64_t *a,
+                          const int64_t *b, size_t n) {
+    return add_ints(r, a, b, n);
+}
+
+
+AVX2_TARGET
+static void add_reals_avx2(double *r, const double *a,
+                           const double *b, size_t n) {
+    add_reals(r, a, b, n);
+}
+
+
+AVX2_TARGET
+static void mul_reals_avx2(double *r, const double *a,
+                           const double *b, size_t n) {
+    mul_reals(r, a, b, n);
+}
+
+
+AVX2_TARGET
+static void scale_reals_avx2(double *r, const double *a, double k, size_t n) {
+    scale_reals(r, a, k, n);
+}
+
+
+static const struct simd_kernels avx2_kernels = {
+    .name = "avx2",
+    .sum_ints = sum_ints_avx2,
+    .sum_reals = sum_reals_avx2,
+    .dot_reals = dot_reals_avx2,
+    .min_ints = min_ints_avx2,
+    .max_ints = max_ints_avx2,
+    .min_reals = min_reals_avx2,
+    .max_reals = max_reals_avx2,
+    .add_ints = add_ints_avx2,
+    .add_reals = add_reals_avx2,
+    .mul_reals = mul_reals_avx2,
+    .scale_reals = scale_reals_avx2
+};
+
+#endif
+
+
+static const struct simd_kernels *kernels = &base_kernels;
+
+
+void simd_init(void) {
+#ifdef SIMD_AVX2
+    /* The base kernels can be forced, to check them on any CPU */
+    const char *force = getenv("CRISP_SIMD");
+    if (force && strcmp(force, "base") == 0)
+        return;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        kernels = &avx2_kernels;
+#endif
+}
+
+
+const char *simd_kernels(void) {
+    return kernels->name;
+}
+
+
+bool simd_sum_ints(const int64_t *a, size_t n, int64_t *sum) {
+    return kernels->sum_ints(a, n, sum);
+}
+
+
+double simd_sum_reals(const double *a, size_t n) {
+    return kernels->sum_reals(a, n);
+}
+
+
+double simd_dot_reals(const double *a, const double *b, size_t n) {
+    return kernels->dot_reals(a, b, n);
+}
+
+
+int64_t simd_min_ints(const int64_t *a, size_t n) {
+    return kernels->min_ints(a, n);
+}
+
+
+int64_t simd_max_ints(const int64_t *a, size_t n) {
+    return kernels->max_ints(a, n);
+}
+
+
+double simd_min_reals(const double *a, size_t n) {
+    return kernels->min_reals(a, n);
+}
+
+
+double simd_max_reals(const double *a, size_t n) {
+    return kernels->max_reals(a, n);
+}
+
+
+bool simd_add_ints(int64_t *r, const int64_t *a, const int64_t *b, size_t n) {
+    return kernels->add_ints(r, a, b, n);
+}
+
+
+void simd_add_reals(double *r, const double *a, const double *b, size_t n) {
+    kernels->add_reals(r, a, b, n);
+}
+
+
+void simd_mul_reals(double *r, const double *a, const double *b, size_t n) {
+    kernels->mul_reals(r, a, b, n);
+}
+
+
+void simd_scale_reals(double *r, const double *a, double k, size_t n) {
+    kernels->scale_reals(r, a, k, n);
+}
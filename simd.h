@@ -0,0 +1,78 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*
+ * Kernels over contiguous arrays of numbers, the backing store of vectors.
+ * The SSE2 versions are the baseline on x86, the AVX2 ones are picked at
+ * startup by simd_init if the CPU supports them, unless CRISP_SIMD is set
+ * to "base" in the environment. Other platforms get plain loops left to the
+ * compiler.
+ *
+ * Decimal reductions keep several partial results and combine them at the
+ * end, the rounding may differ from a left to right fold.
+ */
+void simd_init(void);
+
+/* Name of the kernels in use, for the :stats command */
+const char *simd_kernels(void);
+
+/* Exact sum, true if it doesn't fit an int64_t */
+bool simd_sum_ints(const int64_t *, size_t, int64_t *);
+
+double simd_sum_reals(const double *, size_t);
+
+double simd_dot_reals(const double *, const double *, size_t);
+
+/* Extremes of non empty arrays, NaN if any of the decimals is NaN */
+int64_t simd_min_ints(const int64_t *, size_t);
+
+int64_t simd_max_ints(const int64_t *, size_t);
+
+double simd_min_reals(const double *, size_t);
+
+double simd_max_reals(const double *, size_t);
+
+/* Element-wise sum, true if any element overflows */
+bool simd_add_ints(int64_t *, const int64_t *, const int64_t *, size_t);
+
+void simd_add_reals(double *, const double *, const double *, size_t);
+
+void simd_mul_reals(double *, const double *, const double *, size_t);
+
+void simd_scale_reals(double *, const double *, double, size_t);
+
+
+#endif
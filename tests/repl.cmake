@@ -0,0 +1,18 @@
+# Feed a script to the REPL and compare what it prints with the expected
+# output, the log of the bindings added to the context is left out.
+execute_process(COMMAND ${CRISP}
+                INPUT_FILE ${INPUT}
+                OUTPUT_VARIABLE output
+                RESULT_VARIABLE result)
+
+string(REGEX REPLACE "adding symbol to context [^\n]*\n" "" output "${output}")
+
+file(READ ${EXPECTED} expected)
+
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "${INPUT}: exited with ${result}\n${output}")
+endif ()
+
+if (NOT output STREQUAL expected)
+    message(FATAL_ERROR "${INPUT}: unexpected output\n${output}")
+endif ()
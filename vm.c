@@ -0,0 +1,1094 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include "vm.h"
+#include "builtins.h"
+
+
+/* Computed gotos are a GNU extension, fall back to a switch elsewhere */
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO
+#endif
+
+
+/*
+ * A run of a chunk, either a closure with its frame of arguments or an
+ * expression evaluated at top level. The owner keeps the code alive.
+ */
+struct vm_frame {
+    struct chunk *chunk;
+    struct expr *owner;     /* The closure or the constants of the chunk */
+    struct expr *env;
+    const unsigned char *ip;
+    size_t base;            /* Offset of the first stack slot of the frame */
+    bool owned;             /* Chunk compiled for this run only */
+};
+
+
+/* Code a call is about to run, in a new frame */
+struct vm_call {
+    struct chunk *chunk;
+    struct expr *owner;
+    struct expr *env;
+    bool owned;
+};
+
+
+static struct {
+    struct expr **stack;
+    size_t size;
+    size_t capacity;
+    struct vm_frame *frames;
+    size_t frames_size;
+    size_t frames_capacity;
+    struct expr *sources[VM_CACHE_SIZE];
+    Context *contexts[VM_CACHE_SIZE];
+    struct expr *consts[VM_CACHE_SIZE];
+    struct chunk chunks[VM_CACHE_SIZE];
+    size_t cache_size;
+    struct vm_stats stats;
+} vm = { .cache_size = VM_CACHE_SIZE };
+
+
+/* The enclosing frame comes first, slots follow */
+#define FRAME_PARENT(f)     ((f)->children[0])
+#define FRAME_SLOT(f, i)    ((f)->children[(i) + 1])
+
+
+void vm_init(void) {
+    vm.capacity = VM_STACK_SIZE;
+    vm.stack = malloc(vm.capacity * sizeof(*vm.stack));
+    gc_track_stack(vm.stack, &vm.size);
+    gc_track_stack(vm.consts, &vm.cache_size);
+}
+
+
+static inline unsigned read_u16(const unsigned char *ip) {
+    uint16_t x;
+    memcpy(&x, ip, sizeof(x));
+    return x;
+}
+
+
+/* Parameters of the lambdas enclosing the form being compiled */
+struct scope {
+    struct scope *parent;
+    struct expr *formals;
+};
+
+
+struct compiler {
+    Context *ctx;
+    struct chunk *chunk;
+    struct scope *scope;
+    int depth;
+    struct expr *err;
+};
+
+
+static void emit(struct compiler *c, const void *bytes, size_t len) {
+
+    struct chunk *chunk = c->chunk;
+
+    if (chunk->size + len > chunk->capacity) {
+        chunk->capacity = chunk->capacity ? chunk->capacity * 2 : 64;
+        chunk->code = realloc(chunk->code, chunk->capacity);
+    }
+
+    memcpy(chunk->code + chunk->size, bytes, len);
+    chunk->size += len;
+}
+
+
+static void emit_op(struct compiler *c, opcode op) {
+    unsigned char byte = op;
+    emit(c, &byte, sizeof(byte));
+}
+
+
+static void emit_u16(struct compiler *c, unsigned x) {
+    uint16_t val = x;
+    emit(c, &val, sizeof(val));
+}
+
+
+/* Track the depth of the stack, to check it once before running the chunk */
+static void compile_push(struct compiler *c, int pops) {
+    c->depth += 1 - pops;
+    if (c->depth > c->chunk->max_stack)
+        c->chunk->max_stack = c->depth;
+}
+
+
+static void compile_const(struct compiler *c, struct expr *exp) {
+
+    struct expr *consts = c->chunk->consts;
+
+    if (consts->count > VM_MAX_OPERAND) {
+        c->err = expr_new_err("Expression too large");
+        return;
+    }
+
+    emit_op(c, OP_CONST);
+    emit_u16(c, consts->count);
+    expr_append(consts, exp);
+    compile_push(c, 0);
+}
+
+
+/* Every load site gets a cache of its own, empty until first run */
+static void compile_load(struct compiler *c, unsigned id) {
+
+    struct chunk *chunk = c->chunk;
+
+    if (chunk->loads_size > VM_MAX_OPERAND) {
+        c->err = expr_new_err("Expression too large");
+        return;
+    }
+
+    if (chunk->loads_size == chunk->loads_capacity) {
+        chunk->loads_capacity = chunk->loads_capacity ?
+            chunk->loads_capacity * 2 : 4;
+        chunk->loads = realloc(chunk->loads,
+                               chunk->loads_capacity * sizeof(*chunk->loads));
+    }
+
+    chunk->loads[chunk->loads_size] =
+        (struct load_cache) { .id = id, .version = 0, .slot = NULL };
+
+    emit_op(c, OP_LOAD);
+    emit_u16(c, chunk->loads_size++);
+    compile_push(c, 0);
+}
+
+
+static struct expr *vm_arith(char, struct expr **, int);
+
+
+static const char arith_ops[] = {
+    [OP_ADD] = '+',
+    [OP_SUB] = '-',
+    [OP_MUL] = '*',
+    [OP_DIV] = '/',
+    [OP_MOD] = '%'
+};
+
+
+/*
+ * Find the frame and the slot of a parameter of the enclosing lambdas, the
+ * innermost one shadowing the others. Return false for free symbols.
+ */
+static bool compile_resolve(const struct compiler *c, unsigned id,
+                            int *depth, int *slot) {
+
+    *depth = 0;
+
+    for (struct scope *s = c->scope; s; s = s->parent, (*depth)++) {
+        for (int i = 0; i < s->formals->count; i++) {
+            if (s->formals->children[i]->symbol == id) {
+                *slot = i;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+
+/* Value of a symbol bound to a constant and not shadowed, NULL otherwise */
+static struct expr *compile_get_const(struct compiler *c, struct expr *exp) {
+
+    int depth, slot;
+
+    if (!exp || expr_type(exp) != SYMBOL
+        || compile_resolve(c, exp->symbol, &depth, &slot))
+        return NULL;
+
+    return context_get_const(c->ctx, exp->symbol);
+}
+
+
+/* Forms headed by a symbol bound to an arithmetic builtin get an opcode */
+static int compile_arith_op(struct compiler *c, struct expr *head) {
+
+    struct expr *val = compile_get_const(c, head);
+
+    if (!val || expr_type(val) != FUNCTION)
+        return -1;
+
+    if (val->fn == builtin_add)
+        return OP_ADD;
+    if (val->fn == builtin_sub)
+        return OP_SUB;
+    if (val->fn == builtin_mul)
+        return OP_MUL;
+    if (val->fn == builtin_div)
+        return OP_DIV;
+    if (val->fn == builtin_mod)
+        return OP_MOD;
+
+    return -1;
+}
+
+
+/*
+ * All the operands of the form were compiled to constants, starting at the
+ * given marks: compute the result now and replace their code with a single
+ * constant.
+ */
+static bool compile_fold(struct compiler *c, int op,
+                         size_t code_mark, int const_mark) {
+
+    struct expr *consts = c->chunk->consts;
+    int n = consts->count - const_mark;
+    struct expr *result = vm_arith(arith_ops[op],
+                                   consts->children + const_mark, n);
+
+    if (!result)
+        return false;
+
+    c->chunk->size = code_mark;
+    c->depth -= n;
+    while (consts->count > const_mark)
+        expr_pop(consts, consts->count - 1);
+
+    compile_const(c, result);
+    vm.stats.folded++;
+
+    return true;
+}
+
+
+static void compile_local(struct compiler *c, int depth, int slot) {
+
+    if (depth == 0) {
+        emit_op(c, OP_LOCAL);
+    } else {
+        emit_op(c, OP_UPVAL);
+        emit_u16(c, depth);
+    }
+
+    emit_u16(c, slot);
+    compile_push(c, 0);
+}
+
+
+static void chunk_init(struct chunk *chunk) {
+    chunk->code = NULL;
+    chunk->size = chunk->capacity = 0;
+    chunk->consts = expr_new_sexp();
+    chunk->loads = NULL;
+    chunk->loads_size = chunk->loads_capacity = 0;
+    chunk->max_stack = 0;
+    chunk->active = 0;
+}
+
+
+static bool compile_expr(struct compiler *, struct expr *, bool);
+
+
+/*
+ * Compile the body of a lambda in a scope of its own, nested in the one of
+ * the compiler. Parameters come as a Q-expression of symbols, the body as a
+ * Q-expression of a single form or of the elements of the form.
+ */
+static struct expr *compile_proto(struct compiler *c,
+                                  struct expr *formals, struct expr *body) {
+
+    if (expr_type(formals) != QEXP || expr_type(body) != QEXP) {
+        c->err = expr_new_err("Function 'lambda' passed incorrect types!");
+        return NULL;
+    }
+
+    int n = expr_arg_count(formals);
+
+    if (n == 1 && (expr_type(formals->children[0]) == SEXP
+                   || expr_type(formals->children[0]) == QEXP)) {
+        formals = formals->children[0];
+        n = expr_arg_count(formals);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (expr_type(formals->children[i]) != SYMBOL) {
+            c->err = expr_new_err("Function 'lambda' passed incorrect types!");
+            return NULL;
+        }
+    }
+
+    formals = expr_slice(formals, 0, n);
+    body = expr_unquote(body);
+
+    struct proto *proto = calloc(1, sizeof(*proto));
+    if (!proto) {
+        c->err = expr_new_err("Out of memory");
+        return NULL;
+    }
+
+    struct expr *exp = expr_new_proto(proto);
+    struct scope scope = { .parent = c->scope, .formals = formals };
+    struct compiler inner = {
+        .ctx = c->ctx, .chunk = &proto->chunk, .scope = &scope,
+        .depth = 0, .err = NULL
+    };
+
+    proto->nparams = n;
+    proto->formals = formals;
+    proto->body = body;
+
+    chunk_init(&proto->chunk);
+    compile_expr(&inner, body, true);
+    emit_op(&inner, OP_RETURN);
+
+    if (inner.err) {
+        c->err = inner.err;
+        return NULL;
+    }
+
+    return exp;
+}
+
+
+/* True if the head of a form is the builtin, and not a shadowing parameter */
+static bool compile_is_builtin(struct compiler *c, struct expr *head, fun *fn) {
+
+    struct expr *val = head && expr_type(head) == FUNCTION ?
+        head : compile_get_const(c, head);
+
+    return val && expr_type(val) == FUNCTION && val->fn == fn;
+}
+
+
+/*
+ * Lambdas with literal parameters and body are compiled along with the form
+ * defining them, and see its scope. Any other use of the builtin runs at
+ * top level.
+ */
+static bool compile_lambda(struct compiler *c, struct expr *exp) {
+
+    if (!compile_is_builtin(c, exp->children[0], builtin_lambda)
+        || expr_arg_count(exp) != 3
+        || expr_type(exp->children[1]) != QEXP
+        || expr_type(exp->children[2]) != QEXP)
+        return false;
+
+    struct expr *proto = compile_proto(c, exp->children[1], exp->children[2]);
+    struct expr *consts = c->chunk->consts;
+
+    if (!proto)
+        return true;
+
+    if (consts->count > VM_MAX_OPERAND) {
+        c->err = expr_new_err("Expression too large");
+        return true;
+    }
+
+    emit_op(c, OP_CLOSURE);
+    emit_u16(c, consts->count);
+    expr_append(consts, proto);
+    compile_push(c, 0);
+
+    return true;
+}
+
+
+/* Point the jump operand at the end of the code, from is where it starts */
+static void compile_patch(struct compiler *c, size_t at, size_t from) {
+
+    size_t distance = c->chunk->size - from;
+
+    if (distance > VM_MAX_OPERAND) {
+        c->err = expr_new_err("Expression too large");
+        return;
+    }
+
+    uint16_t val = distance;
+    memcpy(c->chunk->code + at, &val, sizeof(val));
+}
+
+
+/*
+ * Literal branches of an if are compiled in place of the form, in its tail
+ * position if it's in one. A failed condition skips both branches and is
+ * left on the stack as the result.
+ */
+static bool compile_if(struct compiler *c, struct expr *exp, bool tail) {
+
+    if (!compile_is_builtin(c, exp->children[0], builtin_if)
+        || expr_arg_count(exp) != 4
+        || expr_type(exp->children[2]) != QEXP
+        || expr_type(exp->children[3]) != QEXP)
+        return false;
+
+    compile_expr(c, exp->children[1], false);
+    emit_op(c, OP_IF);
+    size_t branch = c->chunk->size;
+    emit_u16(c, 0);
+    emit_u16(c, 0);
+    size_t from = c->chunk->size;
+    c->depth--;
+
+    compile_expr(c, expr_unquote(exp->children[2]), tail);
+    emit_op(c, OP_JUMP);
+    size_t jump = c->chunk->size;
+    emit_u16(c, 0);
+    compile_patch(c, branch, from);
+    c->depth--;
+
+    compile_expr(c, expr_unquote(exp->children[3]), tail);
+    compile_patch(c, jump, jump + 2);
+    compile_patch(c, branch + 2, from);
+
+    return true;
+}
+
+
+/*
+ * Return true if the expression was compiled to a single constant. Calls in
+ * tail position replace the frame of the caller.
+ */
+static bool compile_expr(struct compiler *c, struct expr *exp, bool tail) {
+
+    if (c->err)
+        return false;
+
+    if (exp && expr_type(exp) == SYMBOL) {
+        int depth, slot;
+        if (compile_resolve(c, exp->symbol, &depth, &slot)) {
+            compile_local(c, depth, slot);
+            return false;
+        }
+        struct expr *val = context_get_const(c->ctx, exp->symbol);
+        if (val) {
+            compile_const(c, val);
+            vm.stats.resolved++;
+            return true;
+        }
+        compile_load(c, exp->symbol);
+        return false;
+    }
+
+    /* Everything but symbols and S-expressions evaluates to itself */
+    if (!exp || expr_type(exp) != SEXP) {
+        compile_const(c, exp);
+        return true;
+    }
+
+    if (exp->count > VM_MAX_OPERAND) {
+        c->err = expr_new_err("Expression too large");
+        return false;
+    }
+
+    /* A closure is never a constant, it captures the current frame */
+    if (exp->count > 0 && (compile_lambda(c, exp) || compile_if(c, exp, tail)))
+        return false;
+
+    int op = exp->count > 1 ? compile_arith_op(c, exp->children[0]) : -1;
+    size_t code_mark = c->chunk->size;
+    int const_mark = c->chunk->consts->count;
+    bool constant = true;
+
+    for (int i = op < 0 ? 0 : 1; i < exp->count; i++)
+        if (!compile_expr(c, exp->children[i], false))
+            constant = false;
+
+    if (op < 0) {
+        emit_op(c, tail ? OP_TAIL : OP_CALL);
+        emit_u16(c, exp->count);
+        compile_push(c, exp->count);
+        return false;
+    }
+
+    if (constant && !c->err && compile_fold(c, op, code_mark, const_mark))
+        return true;
+
+    emit_op(c, op);
+    emit_u16(c, exp->count - 1);
+    compile_push(c, exp->count - 1);
+
+    return false;
+}
+
+
+struct expr *vm_compile(Context *ctx, struct chunk *chunk, struct expr *exp) {
+
+    struct compiler c = {
+        .ctx = ctx, .chunk = chunk, .scope = NULL, .depth = 0, .err = NULL
+    };
+
+    chunk_init(chunk);
+
+    compile_expr(&c, exp, true);
+    emit_op(&c, OP_RETURN);
+
+    vm.stats.compiled++;
+
+    return c.err;
+}
+
+
+void vm_chunk_release(struct chunk *chunk) {
+    free(chunk->code);
+    free(chunk->loads);
+    chunk->code = NULL;
+    chunk->size = chunk->capacity = 0;
+    chunk->consts = NULL;
+    chunk->loads = NULL;
+    chunk->loads_size = chunk->loads_capacity = 0;
+}
+
+
+void vm_proto_release(struct proto *proto) {
+    vm_chunk_release(&proto->chunk);
+    free(proto);
+}
+
+
+struct expr *vm_lambda(Context *ctx, struct expr *formals, struct expr *body) {
+
+    struct compiler c = {
+        .ctx = ctx, .chunk = NULL, .scope = NULL, .depth = 0, .err = NULL
+    };
+
+    struct expr *proto = compile_proto(&c, formals, body);
+
+    return proto ? expr_new_lambda(proto, NULL) : c.err;
+}
+
+
+static void vm_chunk_free(struct chunk *chunk) {
+    vm_chunk_release(chunk);
+    free(chunk);
+}
+
+
+/* Make room for the stack to hold size values, it may move */
+static bool vm_reserve(size_t size) {
+
+    if (size <= vm.capacity)
+        return true;
+
+    if (size > VM_STACK_MAX)
+        return false;
+
+    size_t capacity = vm.capacity;
+    while (capacity < size)
+        capacity *= 2;
+    if (capacity > VM_STACK_MAX)
+        capacity = VM_STACK_MAX;
+
+    gc_untrack_stack(vm.stack);
+
+    struct expr **stack = realloc(vm.stack, capacity * sizeof(*stack));
+    if (stack) {
+        vm.stack = stack;
+        vm.capacity = capacity;
+    }
+
+    gc_track_stack(vm.stack, &vm.size);
+
+    return stack != NULL;
+}
+
+
+/*
+ * Push a frame for a call on top of the stack or, for a tail call, put it in
+ * place of the current one, whose values are all dead by then. Return false
+ * if the stack can't grow, the call is dropped.
+ */
+static bool vm_enter(struct vm_call *call, bool tail) {
+
+    size_t base = tail ? vm.frames[vm.frames_size - 1].base : vm.size;
+
+    if (!vm_reserve(base + call->chunk->max_stack))
+        goto overflow;
+
+    if (!tail && vm.frames_size == vm.frames_capacity) {
+        size_t capacity = vm.frames_capacity ? vm.frames_capacity * 2 : 64;
+        struct vm_frame *frames =
+            realloc(vm.frames, capacity * sizeof(*frames));
+        if (!frames)
+            goto overflow;
+        vm.frames = frames;
+        vm.frames_capacity = capacity;
+    }
+
+    struct vm_frame *frame = &vm.frames[tail ? vm.frames_size - 1 :
+                                        vm.frames_size++];
+
+    if (tail) {
+        frame->chunk->active--;
+        gc_pop_root();
+        gc_pop_root();
+        if (frame->owned)
+            vm_chunk_free(frame->chunk);
+    }
+
+    frame->chunk = call->chunk;
+    frame->owner = call->owner;
+    frame->env = call->env;
+    frame->ip = call->chunk->code;
+    frame->base = base;
+    frame->owned = call->owned;
+
+    call->chunk->active++;
+    gc_push_root(call->owner);
+    gc_push_root(call->env);
+    vm.size = base;
+
+    return true;
+
+overflow:
+    if (call->owned)
+        vm_chunk_free(call->chunk);
+    return false;
+}
+
+
+static void vm_leave(void) {
+
+    struct vm_frame *frame = &vm.frames[--vm.frames_size];
+
+    frame->chunk->active--;
+    gc_pop_root();
+    gc_pop_root();
+    if (frame->owned)
+        vm_chunk_free(frame->chunk);
+
+    vm.size = frame->base;
+}
+
+
+/*
+ * Views over the same children, like the ones built by eval on a stored
+ * Q-expression, are the same source and share the cached chunk.
+ */
+static inline bool vm_same_source(struct expr *a, struct expr *b) {
+    return a && a->children == b->children && a->count == b->count;
+}
+
+
+/*
+ * Find the chunk of an expression in the cache, compiling it on a miss. The
+ * chunk in the slot may be running, with eval in the middle: then the new
+ * one is compiled aside, owned by the call and released with its frame.
+ */
+static struct expr *vm_lookup(Context *ctx, struct expr *exp,
+                              struct vm_call *call) {
+
+    size_t slot = (((uintptr_t) exp->children * 0x9E3779B97F4A7C15ULL) >> 32)
+        & (VM_CACHE_SIZE - 1);
+    struct chunk *chunk = &vm.chunks[slot];
+
+    if (vm_same_source(vm.sources[slot], exp) && vm.contexts[slot] == ctx) {
+        *call = (struct vm_call) {
+            .chunk = chunk, .owner = chunk->consts, .env = NULL, .owned = false
+        };
+        return NULL;
+    }
+
+    bool owned = chunk->active > 0;
+
+    if (owned) {
+        chunk = malloc(sizeof(*chunk));
+        if (!chunk)
+            return expr_new_err("Out of memory");
+    } else if (vm.sources[slot]) {
+        vm_chunk_release(chunk);
+        vm.sources[slot] = vm.consts[slot] = NULL;
+    }
+
+    struct expr *err = vm_compile(ctx, chunk, exp);
+
+    if (err) {
+        vm_chunk_release(chunk);
+        if (owned)
+            free(chunk);
+        return err;
+    }
+
+    /*
+     * The source stays alive as last constant, its address can't be freed
+     * and reused while it's in the cache.
+     */
+    expr_append(chunk->consts, exp);
+
+    if (!owned) {
+        vm.sources[slot] = exp;
+        vm.contexts[slot] = ctx;
+        vm.consts[slot] = chunk->consts;
+    }
+
+    *call = (struct vm_call) {
+        .chunk = chunk, .owner = chunk->consts, .env = NULL, .owned = owned
+    };
+
+    return NULL;
+}
+
+
+/*
+ * Bind the arguments of a closure to the slots of a new frame, chained to
+ * the frame the closure was created in
+ */
+static struct expr *vm_apply(struct expr *fn, struct expr **args, int n,
+                             struct vm_call *call) {
+
+    struct proto *proto = LAMBDA_PROTO(fn);
+
+    /* Top level forms keep the end markers of the parser */
+    while (n > 0 && expr_type(args[n - 1]) == SEXP_END)
+        n--;
+
+    if (n != proto->nparams)
+        return expr_new_err("Function passed incorrect number of arguments!");
+
+    struct expr *env = expr_new_sexp();
+
+    expr_append(env, LAMBDA_ENV(fn));
+    for (int i = 0; i < n; i++)
+        expr_append(env, args[i]);
+
+    *call = (struct vm_call) {
+        .chunk = &proto->chunk, .owner = fn, .env = env, .owned = false
+    };
+
+    return NULL;
+}
+
+
+/* Versions are never 0, an empty cache always misses */
+static inline struct expr *vm_load(Context *ctx, struct load_cache *cache) {
+
+    if (cache->version == ctx->version) {
+        vm.stats.load_hits++;
+        return *cache->slot;
+    }
+
+    vm.stats.load_misses++;
+
+    struct expr **slot = context_slot(ctx, cache->id);
+    if (!slot)
+        return expr_new_err("Unbound symbol");
+
+    cache->slot = slot;
+    cache->version = ctx->version;
+
+    return *slot;
+}
+
+
+static struct expr *vm_error(struct expr **args, int n) {
+    for (int i = 0; i < n; i++)
+        if (args[i] && expr_type(args[i]) == ERROR)
+            return args[i];
+    return NULL;
+}
+
+
+/* S-expression evaluated by a call to eval, as the builtin would pick it */
+static struct expr *vm_eval_form(struct expr **args, int n) {
+
+    if (n == 0 || !args[0] || expr_type(args[0]) != QEXP
+        || args[0]->count == 0 || !args[0]->children[0])
+        return NULL;
+
+    struct expr *x = args[0]->children[0];
+
+    if (expr_type(x) == QEXP) {
+        x = expr_slice(x, 0, x->count);
+        x->etype = SEXP;
+    }
+
+    return expr_type(x) == SEXP ? x : NULL;
+}
+
+
+/*
+ * Apply a function to n evaluated arguments, builtins receive them in a new
+ * list that they're free to modify. The first error met is propagated and a
+ * lone value, with no arguments, evaluates to itself.
+ * Closures and eval of an S-expression run in a frame of their own, return
+ * NULL and fill in the call for the caller to enter it.
+ */
+static struct expr *vm_call(Context *ctx, struct expr *head,
+                            struct expr **args, int n, struct vm_call *call) {
+
+    if (head && expr_type(head) == ERROR)
+        return head;
+
+    struct expr *err = vm_error(args, n);
+    if (err)
+        return err;
+
+    if (head && expr_type(head) == LAMBDA)
+        return vm_apply(head, args, n, call);
+
+    if (n == 0)
+        return head;
+
+    if (!head || expr_type(head) != FUNCTION)
+        return expr_new_err("Not a function");
+
+    struct expr *form = head->fn == builtin_eval ? vm_eval_form(args, n) : NULL;
+    if (form)
+        return vm_lookup(ctx, form, call);
+
+    struct expr *list = expr_new_sexp();
+    for (int i = 0; i < n; i++)
+        expr_append(list, args[i]);
+
+    gc_push_root(list);
+    struct expr *result = head->fn(ctx, list);
+    gc_pop_root();
+
+    return result;
+}
+
+
+/* Fold the operands in place, no argument list is built */
+static struct expr *vm_arith(char op, struct expr **args, int n) {
+
+    /* Fixnums are 63 bits, their sum always fits a long long */
+    if (n == 2 && IS_FIXNUM(args[0]) && IS_FIXNUM(args[1])) {
+        if (op == '+')
+            return expr_new_integer(FIXNUM_VAL(args[0]) + FIXNUM_VAL(args[1]));
+        if (op == '-')
+            return expr_new_integer(FIXNUM_VAL(args[0]) - FIXNUM_VAL(args[1]));
+    }
+
+    struct expr *err = vm_error(args, n);
+
+    return err ? err : builtin_arith(args, n, op);
+}
+
+
+#ifdef VM_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define VM_DISPATCH()       goto *labels[*ip++]
+#define VM_CASE(op)         L_##op
+#else
+#define VM_DISPATCH()       break
+#define VM_CASE(op)         case op
+#endif
+
+
+/* Pick up the frame on top, after a call, a return or a move of the stack */
+#define VM_RESUME() do {                                \
+    frame = &vm.frames[vm.frames_size - 1];             \
+    consts = frame->chunk->consts->children;            \
+    ip = frame->ip;                                     \
+    env = frame->env;                                   \
+    top = vm.stack + vm.size;                           \
+} while (0)
+
+
+/*
+ * Closures and evaluated S-expressions run in frames pushed on the same loop
+ * and the C stack doesn't grow with them. Builtins calling back into the VM
+ * still nest a new loop, with its own frames on top.
+ * Collections can only start from OP_CALL and the arithmetic opcodes, the
+ * size of the stack must be up to date there, so that the collector sees
+ * every value in flight.
+ */
+static struct expr *vm_exec(Context *ctx, struct vm_call *call) {
+
+    /* Frames below belong to the loops this one is nested in */
+    size_t entry = vm.frames_size;
+    struct vm_frame *frame;
+    struct expr **consts;
+    const unsigned char *ip;
+    struct expr *env;
+    struct expr **top;
+    struct expr *result = NULL;
+    struct expr *up = NULL;
+    struct vm_call next;
+    size_t sp = 0;
+    bool tail = false;
+    int n = 0;
+
+    if (!vm_enter(call, false))
+        return expr_new_err("Stack overflow");
+
+    VM_RESUME();
+
+#ifdef VM_COMPUTED_GOTO
+    static void *labels[] = {
+        [OP_CONST] = &&L_OP_CONST,
+        [OP_LOAD] = &&L_OP_LOAD,
+        [OP_LOCAL] = &&L_OP_LOCAL,
+        [OP_UPVAL] = &&L_OP_UPVAL,
+        [OP_CLOSURE] = &&L_OP_CLOSURE,
+        [OP_CALL] = &&L_OP_CALL,
+        [OP_TAIL] = &&L_OP_TAIL,
+        [OP_IF] = &&L_OP_IF,
+        [OP_JUMP] = &&L_OP_JUMP,
+        [OP_ADD] = &&L_OP_ADD,
+        [OP_SUB] = &&L_OP_SUB,
+        [OP_MUL] = &&L_OP_MUL,
+        [OP_DIV] = &&L_OP_DIV,
+        [OP_MOD] = &&L_OP_MOD,
+        [OP_RETURN] = &&L_OP_RETURN
+    };
+
+    VM_DISPATCH();
+#else
+    for (;;) switch (*ip++) {
+#endif
+
+    VM_CASE(OP_CONST):
+        *top++ = consts[read_u16(ip)];
+        ip += 2;
+        VM_DISPATCH();
+
+    VM_CASE(OP_LOAD):
+        *top++ = vm_load(ctx, &frame->chunk->loads[read_u16(ip)]);
+        ip += 2;
+        VM_DISPATCH();
+
+    VM_CASE(OP_LOCAL):
+        *top++ = FRAME_SLOT(env, read_u16(ip));
+        ip += 2;
+        VM_DISPATCH();
+
+    VM_CASE(OP_UPVAL):
+        up = env;
+        for (n = read_u16(ip); n > 0; n--)
+            up = FRAME_PARENT(up);
+        *top++ = FRAME_SLOT(up, read_u16(ip + 2));
+        ip += 4;
+        VM_DISPATCH();
+
+    VM_CASE(OP_CLOSURE):
+        *top++ = expr_new_lambda(consts[read_u16(ip)], env);
+        ip += 2;
+        VM_DISPATCH();
+
+    VM_CASE(OP_CALL):
+    VM_CASE(OP_TAIL):
+        tail = ip[-1] == OP_TAIL;
+        n = read_u16(ip);
+        ip += 2;
+        frame->ip = ip;
+        vm.size = top - vm.stack;
+        sp = vm.size - n;
+        gc_maybe_collect();
+        result = n == 0 ? expr_new_sexp() :
+            vm_call(ctx, top[-n], top - n + 1, n - 1, &next);
+        vm.size = sp;
+        if (!result && !vm_enter(&next, tail))
+            result = expr_new_err("Stack overflow");
+        VM_RESUME();
+        if (result)
+            *top++ = result;
+        VM_DISPATCH();
+
+    VM_CASE(OP_IF):
+        result = *--top;
+        if (result && expr_type(result) == ERROR) {
+            *top++ = result;
+            ip += 4 + read_u16(ip + 2);
+        } else if (!result || !expr_truthy(result)) {
+            ip += 4 + read_u16(ip);
+        } else {
+            ip += 4;
+        }
+        VM_DISPATCH();
+
+    VM_CASE(OP_JUMP):
+        ip += 2 + read_u16(ip);
+        VM_DISPATCH();
+
+    VM_CASE(OP_ADD):
+    VM_CASE(OP_SUB):
+    VM_CASE(OP_MUL):
+    VM_CASE(OP_DIV):
+    VM_CASE(OP_MOD):
+        n = read_u16(ip);
+        vm.size = top - vm.stack;
+        gc_maybe_collect();
+        result = vm_arith(arith_ops[ip[-1]], top - n, n);
+        ip += 2;
+        top -= n;
+        *top++ = result;
+        VM_DISPATCH();
+
+    VM_CASE(OP_RETURN):
+        result = top[-1];
+        vm_leave();
+        if (vm.frames_size == entry)
+            return result;
+        VM_RESUME();
+        *top++ = result;
+        VM_DISPATCH();
+
+#ifndef VM_COMPUTED_GOTO
+    }
+#endif
+}
+
+
+#ifdef VM_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+
+struct expr *vm_run(Context *ctx, struct chunk *chunk) {
+
+    struct vm_call call = {
+        .chunk = chunk, .owner = chunk->consts, .env = NULL, .owned = false
+    };
+
+    return vm_exec(ctx, &call);
+}
+
+
+struct expr *vm_eval(Context *ctx, struct expr *exp) {
+
+    struct vm_call call;
+    struct expr *err = vm_lookup(ctx, exp, &call);
+
+    return err ? err : vm_exec(ctx, &call);
+}
+
+
+struct expr *vm_funcall(Context *ctx, struct expr *fn,
+                        struct expr **args, int n) {
+
+    struct vm_call call;
+    struct expr *result = vm_call(ctx, fn, args, n, &call);
+
+    return result ? result : vm_exec(ctx, &call);
+}
+
+
+void vm_stats(struct vm_stats *stats) {
+    *stats = vm.stats;
+}
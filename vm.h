@@ -0,0 +1,180 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2019, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef VM_H
+#define VM_H
+
+#include "core.h"
+
+
+/*
+ * Expressions are compiled to a compact bytecode and run on a stack machine,
+ * every instruction is a one byte opcode followed by its operands:
+ *
+ *   OP_CONST   u16 index       push a constant of the chunk
+ *   OP_LOAD    u16 index       push the value bound to the symbol of a load
+ *                              cache of the chunk
+ *   OP_LOCAL   u16 slot        push a slot of the current frame
+ *   OP_UPVAL   u16 depth       push a slot of the frame depth levels up the
+ *              u16 slot        chain of the current one
+ *   OP_CLOSURE u16 index       push a closure of the PROTO constant over the
+ *                              current frame
+ *   OP_CALL    u16 n           apply the n values on top of the stack, the
+ *                              deepest one being the function
+ *   OP_TAIL    u16 n           same as OP_CALL, in tail position: the frame
+ *                              of the callee takes the place of the current
+ *   OP_IF      u16 else        pop a value, jump forward by else if it's
+ *              u16 end         false, by end leaving it if it's an error
+ *   OP_JUMP    u16 offset      jump forward
+ *   OP_ADD ..  u16 n           fold the n values on top of the stack with the
+ *   OP_MOD                     arithmetic builtin
+ *   OP_RETURN                  return the value on top of the stack
+ *
+ * Operands are stored in native byte order, unaligned.
+ *
+ * Symbols bound to a constant in the context, like the builtins, are
+ * resolved at compile time: arithmetic forms get their own opcode and are
+ * folded into a literal when all of their operands are constant.
+ *
+ * Lambdas are scoped lexically. Their bodies are compiled along with the
+ * form defining them, parameters are resolved then to a depth and a slot:
+ * frames are S-expressions holding the enclosing frame followed by the
+ * slots. Only free symbols are looked up in the context.
+ *
+ * Calls to closures and to eval don't recurse on the C stack, they push a
+ * frame on the VM and the stack grows on demand up to VM_STACK_MAX values.
+ * Tail calls reuse the frame of the caller, so loops written as tail
+ * recursion run in constant space.
+ *
+ * Every free symbol in the code has a load cache of its own, holding the
+ * address of the value it was last found at and the version of the context
+ * back then. As long as the version matches, loading it is a single read.
+ */
+#define VM_STACK_SIZE       (64 * 1024)
+#define VM_STACK_MAX        (4 * 1024 * 1024)
+#define VM_MAX_OPERAND      UINT16_MAX
+#define VM_CACHE_SIZE       256
+
+
+typedef enum {
+    OP_CONST,
+    OP_LOAD,
+    OP_LOCAL,
+    OP_UPVAL,
+    OP_CLOSURE,
+    OP_CALL,
+    OP_TAIL,
+    OP_IF,
+    OP_JUMP,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_RETURN
+} opcode;
+
+
+/* Inline cache of an OP_LOAD, the slot is valid while the version matches */
+struct load_cache {
+    unsigned id;
+    unsigned long version;
+    struct expr **slot;
+};
+
+
+struct chunk {
+    unsigned char *code;
+    size_t size;
+    size_t capacity;
+    struct expr *consts;    /* A list, so that the GC can trace it */
+    struct load_cache *loads;
+    int loads_size;
+    int loads_capacity;
+    int max_stack;          /* Stack slots needed to run the chunk */
+    int active;             /* Runs of the chunk in progress */
+};
+
+
+/* Body of a lambda, formals holds the symbols of the parameters */
+struct proto {
+    struct chunk chunk;
+    int nparams;
+    struct expr *formals;
+    struct expr *body;
+};
+
+
+struct vm_stats {
+    size_t compiled;        /* Chunks compiled, cache misses */
+    size_t folded;          /* Arithmetic forms folded into a literal */
+    size_t resolved;        /* Constant symbols resolved at compile time */
+    size_t load_hits;       /* Loads served by their inline cache */
+    size_t load_misses;     /* Loads that went through the context */
+};
+
+
+/* Register the VM stack with the collector */
+void vm_init(void);
+
+/*
+ * Compile an expression into an empty chunk, return NULL on success or an
+ * ERROR expression. The chunk must be released even on failure. Constant
+ * bindings of the context are resolved, the chunk can only be run with it.
+ */
+struct expr *vm_compile(Context *, struct chunk *, struct expr *);
+
+void vm_chunk_release(struct chunk *);
+
+void vm_proto_release(struct proto *);
+
+/*
+ * Compile a lambda out of its parameters and body, as given to the lambda
+ * builtin, with no enclosing scope. Return a LAMBDA or an ERROR expression.
+ */
+struct expr *vm_lambda(Context *, struct expr *, struct expr *);
+
+/* Chunks can be run any number of times, the source is never touched */
+struct expr *vm_run(Context *, struct chunk *);
+
+/*
+ * Compile and run an expression, chunks are cached by source and context,
+ * re-evaluating the same expression only runs it.
+ */
+struct expr *vm_eval(Context *, struct expr *);
+
+/*
+ * Apply a function to n values from C, closures run on a loop nested in the
+ * current one. A collection may start before it returns.
+ */
+struct expr *vm_funcall(Context *, struct expr *, struct expr **, int);
+
+void vm_stats(struct vm_stats *);
+
+
+#endif